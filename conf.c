@@ -18,15 +18,12 @@
  */
 
 
-/*
- *
- * NOTE: This file is not used currently.
- *
- */
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <strings.h>
+#include <limits.h>
 
 #include <unistd.h>
 #include <sys/types.h>
@@ -42,11 +39,9 @@ static conf_command_t *conf_find_command(conf_command_t *commands, char *p, int
 static int conf_get_int(void *conf, unsigned int offset, char *s, int len);
 static int conf_get_on_off(void *conf, unsigned int offset, char *s, int len);
 static int conf_get_string(void *conf, unsigned int offset, char *s, int len);
-static int conf_get_iarray(void *conf, unsigned int offset, char *s, int len);
 
 
 static int my_atoi(char *p, int len);
-static char *my_substring(char *pos, char *last, char **start, int *len);
 
 
 static conf_command_t main_commands[] = {
@@ -58,6 +53,10 @@ static conf_command_t main_commands[] = {
       conf_get_int,
       offsetof(conf_t, port) },
 
+    { "data_file",
+      conf_get_string,
+      offsetof(conf_t, data_file) },
+
     { "timeout",
       conf_get_int,
       offsetof(conf_t, timeout) },
@@ -74,6 +73,18 @@ static conf_command_t main_commands[] = {
       conf_get_int,
       offsetof(conf_t, running_time) },
 
+    { "rate",
+      conf_get_int,
+      offsetof(conf_t, rate) },
+
+    { "threads",
+      conf_get_int,
+      offsetof(conf_t, threads) },
+
+    { "sockets",
+      conf_get_int,
+      offsetof(conf_t, sockets) },
+
     { "protocol",
       conf_get_string,
       offsetof(conf_t, protocol) },
@@ -93,22 +104,32 @@ int
 conf_parse_file(char *conf_file_name, conf_t **conf)
 {
     int       len;
-    char      buf[8192] = {0};
+    char     *buf;
     conf_t   *cf;
 
-    if ((cf = malloc(sizeof(conf_t))) == NULL) {
+    if ((buf = malloc(CONF_MAX_SIZE)) == NULL) {
         return -1;
     }
 
-    len = conf_read_file(conf_file_name, buf, 8192);
+    len = conf_read_file(conf_file_name, buf, CONF_MAX_SIZE);
     if (len == -1) {
+        free(buf);
+        return -1;
+    }
+
+    if ((cf = conf_create()) == NULL) {
+        free(buf);
         return -1;
     }
 
     if (conf_parse(cf, buf, len) == -1) {
+        free(buf);
+        conf_destroy(cf);
         return -1;
     }
 
+    free(buf);
+
     *conf = cf;
     return 0;
 }
@@ -121,22 +142,29 @@ conf_read_file(char *file_name, char *buf, int len)
 
     fd = open(file_name, O_RDONLY, 0);
     if (fd == -1) {
+        fprintf(stderr, "CONF: can't open %s\n", file_name);
         return -1;
     }
 
     n = size = 0;
     for (;;) {
-        n = read(fd, buf + size, len);
+        n = read(fd, buf + size, len - size);
 
         if (n == 0) {
             break;
         }
 
+        if (n == -1) {
+            fprintf(stderr, "CONF: can't read %s\n", file_name);
+            close(fd);
+            return -1;
+        }
+
         size += n;
-        len -= n;
 
-        if (len <= 0) {
-            /* config file is too large */
+        if (size >= len) {
+            fprintf(stderr, "CONF: %s is too large\n", file_name);
+            close(fd);
             return -1;
         }
     }
@@ -145,103 +173,65 @@ conf_read_file(char *file_name, char *buf, int len)
     return size;
 }
 
+/*
+ * conf_parse:
+ *     one "name = value" directive per line, '#' starts a comment.
+ */
 static int
 conf_parse(conf_t *cf, char *buf, int len)
 {
     conf_command_t  *cmd;
-    char *begin, *end;
-    char *p, *p1, *p2, ch;
-    int skip;
+    char *end, *eol;
+    char *p, *name, *value, *last;
+    int line;
 
-    p1 = p2 = NULL;
-    cmd = NULL;
-    begin = buf;
     end = buf + len;
 
-    enum {
-        directive_start = 0,
-        directive_name,
-        directive_arg
-    } state;
+    for (p = buf, line = 1; p < end; p = eol + 1, line++) {
 
-    state = directive_start;
-    skip = 0;
-
-    for (p = begin; p < end; p++) {
-        ch = *p;
-
-        if (ch == '#') {
-            skip = 1;
-            continue;
+        for (eol = p; eol < end && *eol != '\n'; eol++) {
+            /* void */
         }
 
-        if (skip) {
-            if (ch == '\n') {
-                skip = 0;
-            }
-            continue;
+        /* the comment is not part of the value */
+        for (last = p; last < eol && *last != '#'; last++) {
+            /* void */
         }
 
-        switch (state) {
-        case directive_start:
-            if (is_digit(ch) || is_letter(ch) || ch == '_') {
-                p1 = p;
-                state = directive_name;
-                break;
-            }
-
-            if (!is_blank(ch)) {
-                return -1;
-            }
-
-            break;
-
-        case directive_name:
-
-            if (is_blank(ch)) {
-                p2 = p;
-
-                cmd = conf_find_command(main_commands, p1, p2 - p1);
-                if (cmd == NULL) {
-                    fprintf(stderr, "CONF: not found conf command %s", p1);
-                    return -1;
-                }
-
-                p1 = p;
-                state = directive_arg;
-                break;
-            }
+        while (p < last && is_blank(*p)) p++;
+        while (last > p && (is_blank(last[-1]) || last[-1] == ';')) last--;
 
-            if (!is_digit(ch) && !is_letter(ch) && ch != '_') {
-                fprintf(stderr, "CONF: invalid character(%c) in command", ch);
-                return -1;
-            }
-
-            break;
-
-        case directive_arg:
-
-            if (ch == ';') {
-                p2  = p;
+        if (p == last) {
+            continue;
+        }
 
-                while(is_blank(*p1)) p1++;
+        for (name = p; p < last && (is_digit(*p) || is_letter(*p) || *p == '_'); p++) {
+            /* void */
+        }
 
-                if (cmd->handler(cf, cmd->offset, p1, p2 - p1) != 0) {
-                    fprintf(stderr, "CONF: get value error!");
-                    return -1;
-                }
+        cmd = conf_find_command(main_commands, name, p - name);
+        if (cmd == NULL) {
+            fprintf(stderr, "CONF: unknown directive \"%.*s\" in line %d\n",
+                    (int) (p - name), name, line);
+            return -1;
+        }
 
-                state = directive_start;
-            }
+        while (p < last && is_blank(*p)) p++;
 
-            break;
+        if (p == last || *p != '=') {
+            fprintf(stderr, "CONF: \"=\" expected in line %d\n", line);
+            return -1;
+        }
 
+        for (value = p + 1; value < last && is_blank(*value); value++) {
+            /* void */
         }
-    }
 
-    if (state != directive_start) {
-        fprintf(stderr, "CONF: command not complete");
-        return -1;
+        if (cmd->handler(cf, cmd->offset, value, last - value) != 0) {
+            fprintf(stderr, "CONF: invalid value of %s in line %d\n",
+                    cmd->name, line);
+            return -1;
+        }
     }
 
     return 0;
@@ -254,12 +244,12 @@ conf_find_command(conf_command_t *commands, char *p, int len)
     conf_command_t *cmd;
 
     for (i = 0; ; i++) {
-        cmd = main_commands + i;
+        cmd = commands + i;
         if (cmd->handler == NULL) {
             break;
         }
 
-        if (strncmp(cmd->name, p, len) == 0) {
+        if (strlen(cmd->name) == len && strncmp(cmd->name, p, len) == 0) {
             return cmd;
         }
     }
@@ -275,9 +265,11 @@ conf_get_int(void *conf, unsigned int offset, char *s, int len)
 
     p = (char *) conf;
 
-    v = my_atoi(s, len);
+    if ((v = my_atoi(s, len)) == -1) {
+        return -1;
+    }
 
-    *(int *) (p + offset) = v;
+    *(unsigned int *) (p + offset) = v;
 
     return 0;
 }
@@ -289,13 +281,13 @@ conf_get_on_off(void *conf, unsigned int offset, char *s, int len)
 
     p = (char *) conf;
 
-    if (strncasecmp(s, "off", 3) == 0) {
-        *(int *) (p + offset) = 0;
+    if (len == 3 && strncasecmp(s, "off", 3) == 0) {
+        *(unsigned int *) (p + offset) = 0;
         return 0;
     }
 
-    if (strncasecmp(s, "on", 2) == 0) {
-        *(int *) (p + offset) = 1;
+    if (len == 2 && strncasecmp(s, "on", 2) == 0) {
+        *(unsigned int *) (p + offset) = 1;
         return 0;
     }
 
@@ -311,8 +303,7 @@ conf_get_string(void *conf, unsigned int offset, char *s, int len)
     p = (char *) conf;
 
     if (len == 0) {
-        *(char **) (p + offset) = NULL;
-        return 0;
+        return -1;
     }
 
     if((v = calloc(1, sizeof(char) * (len + 1))) == NULL) {
@@ -320,47 +311,16 @@ conf_get_string(void *conf, unsigned int offset, char *s, int len)
     }
     memcpy(v, s, len);
 
+    free(*(char **) (p + offset));
     *(char **) (p + offset) = v;
 
     return 0;
 }
 
-static int
-conf_get_iarray(void *conf, unsigned int offset, char *s, int len)
-{
-    char          *p, *c, *start;
-    int            l, value;
-    struct _list  *rcodes;
-
-    if ((rcodes = alloc_list(NULL, NULL)) == NULL) {
-        return -1;
-    }
-
-    for (p = s; p < s + len; ) {
-        p = my_substring(p, s + len, &start, &l);
-
-        if ((value = my_atoi(start, l)) == -1) {
-            goto failure;
-        }
-
-        list_add2(rcodes, (void *) value);
-    }
-
-    c = (char *) conf;
-
-    *(struct _list **) (c + offset) = rcodes;
-
-    return 0;
-
- failure:
-    free(rcodes);
-    return -1;
-}
-
 static int
 my_atoi(char *s, int n)
 {
-    int  value;
+    int  value, digit;
 
     if (n == 0) {
         return -1;
@@ -371,35 +331,16 @@ my_atoi(char *s, int n)
             return -1;
         }
 
-        value = value * 10 + (*s - '0');
-    }
-
-    return value < 0 ? -1 : value;
-}
-
-static char *
-my_substring(char *pos, char *last, char **start, int *len)
-{
-    char *p;
+        digit = *s - '0';
 
-    for (p = pos; p < last; p++) {
-        if (*p == ' ' || *p == '\t' || *p == '\n') {
-            continue;
+        if (value > (INT_MAX - digit) / 10) {
+            return -1;
         }
-        break;
-    }
-
-    *start = p;
 
-    for ( ; p < last; p++) {
-        if (*p == ' ' || *p == '\t' || *p == '\n') {
-            break;
-        }
+        value = value * 10 + digit;
     }
 
-    *len = p - *start;
-
-    return p;
+    return value;
 }
 
 
@@ -413,14 +354,18 @@ conf_create()
     }
 
     main_conf->name_server = NULL;
-    main_conf->port = 53;
-    main_conf->timeout = 3000;
-    main_conf->max_query = 1000;
-    main_conf->concurrent_query = 100;
-    main_conf->running_time = 1000000;
+    main_conf->port = CONF_UNSET;
+    main_conf->data_file = NULL;
+    main_conf->timeout = CONF_UNSET;
+    main_conf->max_query = CONF_UNSET;
+    main_conf->concurrent_query = CONF_UNSET;
+    main_conf->running_time = CONF_UNSET;
+    main_conf->rate = CONF_UNSET;
+    main_conf->threads = CONF_UNSET;
+    main_conf->sockets = CONF_UNSET;
     main_conf->protocol = NULL;
     main_conf->addr_family = NULL;
-    main_conf->verbose = 0;
+    main_conf->verbose = CONF_UNSET;
 
     return main_conf;
 }
@@ -429,6 +374,7 @@ int
 conf_destroy(conf_t *cf)
 {
     free(cf->name_server);
+    free(cf->data_file);
     free(cf->protocol);
     free(cf->addr_family);
 
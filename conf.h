@@ -4,6 +4,9 @@
 
 #define DEFAULT_CONF_FILE "./dnsperf.conf"
 
+#define CONF_UNSET    ((unsigned int) -1)    /* not given in the file */
+#define CONF_MAX_SIZE 65536
+
 #define is_digit(c)   ((c) >= '0' && (c) <= '9')
 #define is_letter(c)  (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z'))
 #define is_blank(c)   ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
@@ -16,16 +19,21 @@ typedef struct {
     unsigned int offset;
 } conf_command_t;
 
+/* every field is CONF_UNSET or NULL unless the file sets it */
 typedef struct {
     char         *name_server;
     unsigned int  port;
+    char         *data_file;
     unsigned int  timeout;
     unsigned int  max_query;
     unsigned int  concurrent_query;
     unsigned int  running_time;
+    unsigned int  rate;
+    unsigned int  threads;
+    unsigned int  sockets;
     char         *protocol;
     char         *addr_family;
-    unsigned      verbose;
+    unsigned int  verbose;
 } conf_t;
 
 conf_t *conf_create();
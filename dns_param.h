@@ -126,7 +126,9 @@ typedef enum {
     DNS_OPTTYPE_DAU           = 4,
     DNS_OPTTYPE_DHU           = 5,
     DNS_OPTTYPE_N3U           = 6,
-    DNS_OPTTYPE_CLIENT_SUBNET = 8
+    DNS_OPTTYPE_CLIENT_SUBNET = 8,
+    DNS_OPTTYPE_COOKIE        = 10,
+    DNS_OPTTYPE_PADDING       = 12
 } dns_opttype_t;
 
 #define DNS_MESSAGE_HEADER_LEN		12
@@ -139,6 +141,8 @@ typedef enum {
 #define DNS_HEADER_FLAG_RA		0x0080U     /* Recursion Allowed */
 #define DNS_HEADER_FLAG_AD		0x0020U     /* Authentic Data. Used by DNSSEC */
 #define DNS_HEADER_FLAG_CD		0x0010U     /* Checking Disabled. Used by DNSSEC */
+#define DNS_HEADER_OPCODE_MASK	0x7800U
+#define DNS_HEADER_RCODE_MASK	0x000FU
 
 /* EDNS Header Flags */
 #define DNS_EDNS_MESSAGEFLAGS_DO 0x8000U    /* DNSSEC answer OK */
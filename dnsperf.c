@@ -17,6 +17,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef HAVE_SENDMMSG
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -25,14 +29,32 @@
 #include <sys/time.h>
 #include <signal.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <arpa/nameser.h>
-#include <arpa/nameser_compat.h>
-#include <resolv.h>
 
 #include <events.h>
 #include <sock.h>
+#include <list.h>
+#include <dns_param.h>
+#include <histogram.h>
+#include <message.h>
+#include <timer.h>
+#include <conf.h>
+#include <pcapfile.h>
 
 
 /*
@@ -46,13 +68,29 @@ typedef struct timeval timeval_t;
 #define UDP   1
 #define TCP   2
 
+/* query selection policies */
+#define SELECT_SEQUENTIAL  1
+#define SELECT_RANDOM      2
+#define SELECT_WEIGHTED    3
+
+/* how queries are spread over the servers, -D */
+#define DIST_RR            1
+#define DIST_WEIGHTED      2
+#define DIST_HASH          3
+
+/* source addresses tried before a socket is given up, -a -x */
+#define SOURCE_TRIES       16
+
 #define DEFAULT_SERVER    "127.0.0.1"
 #define DEFAULT_PORT      "53"
 #define DEFAULT_TIMEOUT   "3000"      /* ms */
 #define DEFAULT_QUERY_NUM "1000"
 #define DEFAULT_C_QUERY_NUM "100"
+#define DEFAULT_THREAD_NUM  "1"
+#define DEFAULT_BATCH       "32"
 
 #define MAX_DOMAIN_LEN     255
+#define EDNS_UDP_SIZE      1024
 
 
 /* query states */
@@ -63,49 +101,276 @@ typedef struct timeval timeval_t;
 #define F_DONE          8  /* all done */
 
 typedef struct data_s {
-    unsigned int  qtype;
-    unsigned int  len;         /* domain's len */
-    char          domain[MAX_DOMAIN_LEN];
+    unsigned int    name_off;    /* domain in g_name_arena, not terminated */
+    unsigned short  name_len;
+    unsigned short  qtype;
+
+    unsigned int    tmpl_off;    /* wire format query in g_template_arena */
+    unsigned int    tmpl_len;
 } data_t;
 
+typedef struct sock_s sock_t;
+typedef struct worker_s worker_t;
+
+/* a target server of -s */
+typedef struct server_s {
+    char            *name;
+    unsigned int     port;        /* 0: the one of -p */
+    unsigned int     weight;
+    uint64_t         weight_end;  /* running sum of the weights */
+    dns_perf_addr_t  addr;
+} server_t;
+
+/* a client subnet of -e */
+typedef struct ecs_subnet_s {
+    int             family;      /* ECS family, 1: IPv4, 2: IPv6 */
+    u_char          addr[16];
+    unsigned int    range;       /* bits taken from addr */
+    unsigned int    prefix;      /* source prefix sent */
+    unsigned int    weight;
+    uint64_t        weight_end;  /* running sum of the weights */
+} ecs_subnet_t;
+
+/* -e pools: the OPT RDLEN and client subnet of a query, see dns_perf_query_iov() */
+typedef struct ecs_wire_s {
+    unsigned char   len;
+    u_char          wire[2 + DNS_ECS_OPTION_LEN(16)];
+} ecs_wire_t;
+
+/*
+ * Kept small, there may be a million of them.  A query is sent straight
+ * from the template of its data, see dns_perf_query_iov().
+ */
 typedef struct query_s {
+    int           id;
+    u_char        id_wire[2];  /* id in network order */
+    unsigned char state;
+
+    sock_t       *sock;        /* socket carrying this query */
+    data_t       *data;
+
+    dns_perf_timer_t timer;    /* expires when the query times out */
+    uint64_t      send_time;   /* usec, when the query was due, latency is
+                                  measured from then */
+    uint64_t      retry_time;  /* usec, -R: when the truncated answer came
+                                  and it was asked again over TCP, 0 while
+                                  on UDP */
+
+    LINK(struct query_s) link; /* linked in sock->pending while F_SENDING,
+                                  in worker->free_list while F_UNUSED */
+} query_t;
+
+/*
+ * A connected UDP socket.  Pooled sockets (-S) live for the whole run and
+ * carry many outstanding queries at once, responses are matched back to
+ * their query_t by message ID.  Without -S every query opens an ephemeral
+ * socket which is closed as soon as its only query is finished.
+ */
+struct sock_s {
     dns_perf_event_ops_t ops;
 
-    int           id;
-    int           fd;          /* socket fd */
+    int             fd;
+    int             ephemeral;
+    int             completion; /* reads and writes go through the event system */
+    unsigned short  next_id;
+    unsigned int    outstanding;
+
+    worker_t       *worker;    /* owner of this socket */
+    server_t       *server;    /* the one it is connected to */
+    dns_perf_addr_t local;     /* -w: the address it is bound to */
+
+    query_t       **ids;       /* message id -> query, pooled sockets only */
+    query_t        *query;     /* the query of an ephemeral socket */
+
+    LIST(query_t)   pending;   /* queries waiting to be sent */
+    LINK(sock_t)    flink;     /* linked in worker->flush_list */
+
+    /* TCP (-P tcp) connections only */
+    int             tcp;
+    int             connecting;
+    u_char         *rbuf;      /* responses not completely read yet */
+    int             rsize;
+    int             rlen;
+    u_char         *wbuf;      /* unwritten tail of a partially sent query */
+    int             wlen;
+};
+
+#define MAX_SOCK_QUERIES   65536   /* 16 bits of message id */
+#define MAX_RECV_LOOP      256     /* responses read per readable event */
+#define MAX_RECV_SIZE      4096    /* longer responses are truncated */
+#define MAX_BATCH          128     /* datagrams per sendmmsg/recvmmsg */
+#define QUERY_IOV          4       /* iovecs of one query at most */
+#define TCP_RBUF_SIZE      4096    /* grown for longer responses */
+#define TIMER_TICK         1000    /* usec, resolution of query timeouts */
+#define REPORT_WAKEUP      100     /* ms, longest sleep of a worker with -i */
+#define CAPTURE_RING_SIZE  8192    /* slots of the capture ring of a worker */
+#define CAPTURE_SNAPLEN    PACKETSZ  /* bytes of a DNS message captured */
+#define CAPTURE_WAKEUP     10      /* ms, sleep of the capture thread when idle */
+
+/* -w: a DNS message recorded by dns_perf_capture() */
+typedef struct capture_slot_s {
+    uint64_t             time;     /* usec, of dns_perf_now() */
+    unsigned short       len;
+    unsigned short       caplen;   /* bytes of it in data */
+    dns_perf_pcap_udp_t  addr;
+    u_char               data[CAPTURE_SNAPLEN];
+} capture_slot_t;
+
+#ifndef HAVE_SENDMMSG
+struct mmsghdr {
+    struct msghdr  msg_hdr;
+    unsigned int   msg_len;
+};
+#endif
+
+typedef struct stats_s {
+    unsigned int  send_number;
+    unsigned int  recv_number;
+    unsigned int  success_number;  /* 0 */
+    unsigned int  formerr_number;  /* 1 */
+    unsigned int  serverr_number;  /* 2 */
+    unsigned int  nxdomain_number; /* 3 */
+    unsigned int  notimp_number;   /* 4 */
+    unsigned int  refuse_number;   /* 5 */
+    unsigned int  other_number;    /* other rcode */
+    unsigned int  skip_number;     /* -T: no free query when one was due */
+    unsigned int  lost_number;     /* timed out or failed, no response */
+    unsigned int  truncated_number; /* TC set */
+    unsigned int  empty_number;    /* NOERROR without answers */
+    unsigned int  mismatch_number; /* question not the one asked, ignored */
+    unsigned int  malformed_number; /* not a valid response, ignored */
+    unsigned int  retry_number;    /* -R: truncated, asked again over TCP */
+    unsigned int  retry_recv_number; /* -R: answered over TCP */
+
+    dns_perf_histogram_t  latency; /* round-trip time of responses, usec */
+
+    /* -R: the queries answered over TCP */
+    dns_perf_histogram_t  udp_latency;   /* until the truncated answer */
+    dns_perf_histogram_t  tcp_latency;   /* of the TCP query */
+    dns_perf_histogram_t  retry_latency; /* both together */
+} stats_t;
+
+/*
+ * A worker runs its own event loop in its own thread (-n).  Everything it
+ * touches on the hot path (queries, sockets, event system, statistics)
+ * is private to it, the results are merged by dns_perf_statistic().
+ */
+struct worker_s {
+    int           index;
+    pthread_t     tid;
+    int           ret;
 
-    u_char        send_buf[PACKETSZ];
-    int           send_len;
-    int           send_pos;
+    query_t      *query_array;
+    unsigned int  query_array_len;    /* share of g_concurrent_query */
+    unsigned int  query_number;       /* share of g_query_number */
+    LIST(query_t) free_list;          /* queries ready to be sent */
+    unsigned int  busy;               /* queries not in free_list */
 
-    /* DNS respond maybe bigger than PACKETSZ, but we only read PACKETSZ bytes */
-    u_char        recv_buf[PACKETSZ];
-    int           recv_pos;
+    /* -C: live settings, copied when g_conf_seq changes */
+    unsigned int  conf_seq;
+    unsigned int  query_limit;        /* share of g_concurrent_query */
+    unsigned int  timeout;            /* g_timeout */
 
-    unsigned int  state;
-    timeval_t     sands;
+    unsigned int  next_data;          /* g_data_array index, sequential */
+    uint64_t      rand;               /* xorshift state, random/weighted */
 
-    data_t       *data;
-} query_t;
+    double        send_interval;      /* usec between queries with -T */
+    double        next_send;          /* usec, when the next one is due */
+    double        replay_start;       /* usec, -r: when the capture began */
+    uint64_t      replay_round;       /* -r: passes over the capture */
+
+    sock_t       *sock_array;         /* len = share of g_sock_number for */
+    unsigned int  sock_array_len;     /*   every server, or query_array_len */
+    unsigned int  sock_number;        /* of every server */
+    unsigned int  sock_next;
+    unsigned int  server_next;        /* -D rr */
+    uint64_t      source_next;        /* -a -x: of the next socket opened */
+
+    sock_t       *retry_array;        /* -R: TCP, like sock_array */
+    unsigned int  retry_next;
+    unsigned int  retry_failed;       /* -R: retries without a connection */
+
+    LIST(sock_t)  flush_list;         /* sockets with queued queries */
+
+    dns_perf_timer_wheel_t timers;    /* timeouts of the queries */
+
+    stats_t       stats;
+    stats_t      *server_stats;       /* of every server */
+
+    ecs_wire_t   *ecs_array;          /* -e pools: of every query */
+
+    /*
+     * -w: ring of CAPTURE_RING_SIZE slots filled by the worker and
+     * emptied by the capture thread, head and tail only grow.
+     */
+    capture_slot_t *capture_ring;
+    unsigned int  capture_head;
+    unsigned int  capture_tail;
+    unsigned int  capture_next;       /* queries until the next sampled */
+    unsigned int  capture_dropped;    /* packets, the ring was full */
+
+    /* -i: copy of stats taken when g_report_seq changes */
+    pthread_mutex_t report_lock;
+    stats_t       report;
+    unsigned int  report_seq;
+    int           finished;           /* report is final */
+
+    /* batched I/O vectors, responses are read into recv_buf */
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec   iovs[(QUERY_IOV + 1) * MAX_BATCH + 1];
+    u_char         lens[MAX_BATCH][2];     /* TCP length prefixes */
+    u_char         recv_buf[MAX_BATCH][MAX_RECV_SIZE];
+};
 
 
 
 /*
  * Global vars.
  */
-char         *g_name_server;
+server_t     *g_server_array;    /* -s, in the order given */
+unsigned int  g_server_number;
+uint64_t      g_server_weight_total;
+int           g_distribute = DIST_RR;
+dns_perf_source_t *g_source_array;  /* -a */
+unsigned int  g_source_number;
+uint64_t      g_source_total[2];    /* addresses of -a, inet and inet6 */
+unsigned int  g_source_port_low;    /* -x, 0: the kernel picks */
+unsigned int  g_source_port_high;
 unsigned int  g_name_server_port;
 char         *g_data_file_name;
-char         *g_real_client;
+char         *g_real_client;     /* -e, as given */
+ecs_subnet_t *g_ecs_array;
+unsigned int  g_ecs_number;
+uint64_t      g_ecs_weight_total;
+int           g_ecs_pool;        /* a client subnet is drawn for every query */
+int           g_ecs_slot_len;    /* RDLEN and client subnet in the templates */
 unsigned int  g_timeout;
 unsigned int  g_perf_time;
 unsigned int  g_query_number;
 unsigned int  g_concurrent_query;
 unsigned int  g_interval;
+unsigned int  g_sock_number;   /* 0: one socket per query */
+unsigned int  g_thread_number;
+unsigned int  g_batch;
+unsigned int  g_rate;          /* -T: queries per second, 0: closed loop */
 int           g_layer4_protocol = UDP;
-int           g_net_family = AF_INET;
+int           g_net_family = AF_UNSPEC;  /* -f, else that of the servers */
 int           g_print_rcode_num;
 int           g_report_rcode;
+int           g_tcp_retry;       /* -R: ask truncated queries again over TCP */
+
+/* -X: the EDNS0 profile baked into every query */
+int           g_edns;
+unsigned int  g_edns_udp_size = EDNS_UDP_SIZE;
+unsigned int  g_edns_flags;
+unsigned int  g_edns_padding;    /* block size, 0: no padding */
+u_char        g_edns_options[PACKETSZ];
+int           g_edns_options_len;
+char         *g_event_sys_name;  /* -E, NULL: the default one */
+char         *g_json_file_name;  /* -o: JSON summary, "-" for stdout */
+char         *g_csv_file_name;   /* -O: CSV line of every -i interval */
+FILE         *g_csv_file;
+FILE         *g_machine_stdout;  /* the real stdout with -o - or -O - */
 
 timeval_t     g_query_start;
 timeval_t     g_query_end;
@@ -113,26 +378,60 @@ timeval_t     g_query_end;
 /* Stores <domain, qtype> read from data `g_data_file_handler' */
 data_t       *g_data_array;
 int           g_data_array_len;
-query_t      *g_query_array;   /* len = g_concurrent_query */
+
+/* how every send picks its entry of g_data_array */
+int           g_select = SELECT_RANDOM;
+
+/* running sum of the weight column, only with SELECT_WEIGHTED */
+uint64_t     *g_weight_array;
+uint64_t      g_weight_total;
+
+/* -r: the timing of a capture replayed, usec since its first query */
+double        g_replay_speed;    /* 0: not replayed */
+uint64_t     *g_replay_time;
+uint64_t      g_replay_span;     /* of one pass over the capture */
+
+/* domains of g_data_array, back to back */
+char         *g_name_arena;
+size_t        g_name_arena_len;
+
+/* wire format queries of g_data_array, message id 0 */
+u_char       *g_template_arena;
+size_t        g_template_arena_len;
+size_t        g_template_arena_size;
+worker_t     *g_worker_array;  /* len = g_thread_number */
 
 /* epoll vars */
 int                  g_epoll_fd;
 struct epoll_event  *g_epoll_events;
 
 
-/* statistics */
-unsigned int  g_send_number;
-unsigned int  g_recv_number;
-unsigned int  g_success_number;  /* 0 */
-unsigned int  g_formerr_number;  /* 1 */
-unsigned int  g_serverr_number;  /* 2 */
-unsigned int  g_nxdomain_number; /* 3 */
-unsigned int  g_notimp_number;   /* 4 */
-unsigned int  g_refuse_number;   /* 5 */
-unsigned int  g_other_number;    /* other rcode */
+/* statistics, merged from all workers */
+stats_t       g_stats;
+stats_t      *g_server_stats;    /* of every server, merged likewise */
+
+
+volatile int  g_stop;  /* 1: running   0: stop */
 
+/* -w: sampled queries and responses written to a pcapng file */
+char         *g_capture_file_name;
+FILE         *g_capture_file;
+unsigned int  g_capture_sample = 1;  /* -W: one query in that many */
+int           g_capture_errors;      /* -W errors: error RCODEs and timeouts */
+volatile int  g_capture_quit;
+unsigned int  g_capture_written;     /* packets */
+int           g_capture_failed;      /* writing the file failed */
 
-int           g_stop;  /* 1: running   0: stop */
+/* -C: SIGHUP asks to read the file again, the first worker to see it does */
+char                  *g_conf_file_name;
+volatile int           g_reload;
+volatile unsigned int  g_conf_seq;
+unsigned int           g_concurrent_limit;  /* queries allocated at start */
+pthread_mutex_t        g_conf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* -i: bumped by the reporter thread at every interval */
+volatile unsigned int  g_report_seq;
+volatile int           g_report_quit;
 
 
 /*
@@ -146,29 +445,84 @@ void dns_perf_show_info()
 void dns_perf_show_usage()
 {
     fprintf(stderr,"\n"
-            "Usage: dnsperf [-d datafile] [-s server_addr] [-p port] [-q num_queries]\n"
+            "Usage: dnsperf [-C conf file] [-d datafile]\n"
+            "               [-s server_addr[#port][@weight]]...\n"
+            "               [-D rr|weighted|hash] [-a source_addr[/prefix],...]\n"
+            "               [-x port[-port]] [-p port] [-q num_queries]\n"
             "               [-t timeout] [-Q max queries] [-c concurrent queries]\n"
             "               [-l running time] [-e real client ip] [-P udp|tcp]\n"
-            "               [-f family] [-T qps] [-c] [-v] [-h]\n\n"
-            "  -d specifies the input data file (default: stdin)\n"
-            "  -s sets the dns server's address (default: %s)\n"
-            "  -p sets the dns server's port (default: %s)\n"
+            "               [-f family] [-S sockets] [-n threads] [-B batch]\n"
+            "               [-T qps] [-r speed] [-m sequential|random|weighted]\n"
+            "               [-i interval]\n"
+            "               [-E event system] [-o json file] [-O csv file]\n"
+            "               [-w pcapng file] [-W sample|errors]\n"
+            "               [-X edns options] [-R] [-v] [-h]\n\n"
+            "  -C reads settings from the given file, the options after it override\n"
+            "     them, SIGHUP reads it again and applies its rate, concurrent_query\n"
+            "     and timeout while running\n"
+            "  -d specifies the input data file, text or a pcap or pcapng capture whose\n"
+            "     UDP queries are sent with new message ids (default: stdin)\n"
+            "  -s sets the dns server's address, optionally with its own port and a\n"
+            "     weight, repeat it to spread the queries over several servers\n"
+            "     (default: %s)\n"
+            "  -D spreads the queries over the servers of -s in turn, at random\n"
+            "     by their weights or by a hash of the domain, rr, weighted or hash\n"
+            "     (default: rr)\n"
+            "  -a sends from the given local addresses or CIDR ranges, every socket\n"
+            "     is bound to the next one (default: the kernel picks)\n"
+            "  -x sends from the given local port or range of ports, with -a every\n"
+            "     address is used before the next port (default: the kernel picks)\n"
+            "  -p sets the dns server's port, of the servers without one (default: %s)\n"
             "  -t specifies the timeout for query completion in millisecond (default: %s)\n"
             "  -Q specifies the maximum number of queries to be send (default: %s)\n"
             "  -c specifies the number of concurrent queries (default: %s)\n"
-            "     dns_perf will randomly pick <domain, type> from data file \n"
             "  -l specifies how long to run tests in seconds (no default)\n"
-            "  -i Specifies interval of queries in seconds. The default number is zero.\n"
+            "  -i prints the statistics of every interval of the given seconds while\n"
+            "     running (default: 0, only the final statistics)\n"
             "  -e This will sets the real client IP in query string following the rules \n"
-            "       defined in edns-client-subnet\n"
+            "       defined in edns-client-subnet, IPv4 or IPv6 with an optional\n"
+            "       /source prefix (default: the whole address). A list of\n"
+            "       address/range/prefix[@weight] draws a random /prefix out of\n"
+            "       one of the ranges for every query\n"
             "  -P specifies the transport layer protocol to send DNS quires,\n"
             "     udp or tcp (default: udp)\n"
-            "  -f specify address family of DNS transport, inet or inet6 (default: inet)\n"
+            "  -f specify address family of DNS transport, inet or inet6 (default: the\n"
+            "     family of the server address)\n"
+            "  -S specifies the number of persistent UDP sockets or TCP connections shared\n"
+            "     by all queries, 0 opens a new socket for every query (default: 0)\n"
+            "  -n specifies the number of worker threads, each with its own event loop,\n"
+            "     queries and sockets, -c -Q and -S are divided between them (default: %s)\n"
+            "  -T sends queries at the given rate per second whatever the responses do\n"
+            "     (open loop), -c then limits the queries in flight (default: closed loop)\n"
+            "  -r sends the queries of a capture in order at the times they were\n"
+            "     captured, at the given speed, 1 as captured, 2 twice as fast, once\n"
+            "     unless -Q or -l are given\n"
+            "  -B specifies the max number of datagrams sent or received by one system\n"
+            "     call, 1 disables batching (default: %s, max: %d)\n"
+            "  -m picks the <domain, type> of every query sent from the data file in\n"
+            "     file order, uniformly at random or weighted by the third column of\n"
+            "     each line, sequential, random or weighted (default: random)\n"
+            "  -E selects the event system, epoll (kqueue on BSD), epoll-et or\n"
+            "     io_uring where built in (default: epoll)\n"
+            "  -o writes configuration, counters and latency histogram of the run as\n"
+            "     JSON to the given file, - for stdout (the rest goes to stderr)\n"
+            "  -O writes one CSV line of every -i interval to the given file,\n"
+            "     - for stdout (the rest goes to stderr)\n"
+            "  -w writes sampled queries and their responses to the given pcapng\n"
+            "     file, at most %d bytes of each\n"
+            "  -W samples one query in the given number for -w, or only the queries\n"
+            "     answered with an error RCODE or timed out and the malformed or\n"
+            "     mismatched responses (default: 1, all)\n"
+            "  -X sends an EDNS0 OPT record in every query, a comma separated list\n"
+            "     of do, bufsize=N, nsid, cookie[=hex], padding=N (block size) and\n"
+            "     opt=code[:hex] (default: only with -e, bufsize=%d)\n"
+            "  -R asks a query again over TCP when its UDP answer is truncated\n"
             "  -v verbose: report the RCODE of each response on stdout\n"
             "  -h print this usage\n"
             "\n",
             DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_TIMEOUT, DEFAULT_QUERY_NUM,
-            DEFAULT_C_QUERY_NUM);
+            DEFAULT_C_QUERY_NUM, DEFAULT_THREAD_NUM, DEFAULT_BATCH, MAX_BATCH,
+            CAPTURE_SNAPLEN, EDNS_UDP_SIZE);
 }
 
 /*
@@ -213,6 +567,412 @@ int dns_perf_set_uint(unsigned int *dst, char *src)
 	return 0;
 }
 
+/*
+ * dns_perf_add_server:
+ *     append a server of -s, "address[#port][@weight]".
+ */
+int dns_perf_add_server(char *src)
+{
+    server_t  *array, *server;
+    char      *p;
+    long       v;
+
+    array = realloc(g_server_array, (g_server_number + 1) * sizeof(server_t));
+    if (array == NULL) {
+        fprintf(stderr, "Error allocating memory for server: %s\n", src);
+        return -1;
+    }
+
+    g_server_array = array;
+    server = &array[g_server_number];
+    memset(server, 0, sizeof(server_t));
+    server->weight = 1;
+
+    if (dns_perf_set_str(&server->name, src) == -1) {
+        return -1;
+    }
+
+    if ((p = strchr(server->name, '@')) != NULL) {
+        *p++ = '\0';
+        v = atol(p);
+        if (v <= 0 || v > 1000000) {
+            fprintf(stderr, "Invalid server weight: %s\n", p);
+            free(server->name);
+            return -1;
+        }
+        server->weight = v;
+    }
+
+    if ((p = strchr(server->name, '#')) != NULL) {
+        *p++ = '\0';
+        v = atol(p);
+        if (v <= 0 || v > 65535) {
+            fprintf(stderr, "Invalid server port: %s\n", p);
+            free(server->name);
+            return -1;
+        }
+        server->port = v;
+    }
+
+    if (server->name[0] == '\0') {
+        free(server->name);
+        return -1;
+    }
+
+    g_server_number++;
+
+    return 0;
+}
+
+/*
+ * dns_perf_clear_servers:
+ *     forget the servers given so far, the ones of -C when -s follows it.
+ */
+static void dns_perf_clear_servers()
+{
+    int  i;
+
+    for (i = 0; i < g_server_number; i++) {
+        free(g_server_array[i].name);
+    }
+
+    free(g_server_array);
+    g_server_array = NULL;
+    g_server_number = 0;
+}
+
+/*
+ * dns_perf_add_sources:
+ *     append the source addresses of -a, "addr[/prefix][,addr[/prefix]]...".
+ */
+int dns_perf_add_sources(char *src)
+{
+    dns_perf_source_t  *array;
+    char               *buf, *p, *save;
+
+    if ((buf = strdup(src)) == NULL) {
+        return -1;
+    }
+
+    for (p = strtok_r(buf, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+        array = realloc(g_source_array,
+                        (g_source_number + 1) * sizeof(dns_perf_source_t));
+        if (array == NULL) {
+            free(buf);
+            return -1;
+        }
+
+        g_source_array = array;
+
+        if (dns_perf_parse_source(p, &array[g_source_number]) == -1) {
+            free(buf);
+            return -1;
+        }
+
+        g_source_total[array[g_source_number].family == AF_INET6]
+            += array[g_source_number].count;
+        g_source_number++;
+    }
+
+    free(buf);
+
+    return g_source_number ? 0 : -1;
+}
+
+/*
+ * dns_perf_parse_subnet:
+ *     parse "address[/range[/prefix]][@weight]" of -e into `e'.  The
+ *     first `range' bits of every client subnet sent are those of the
+ *     address, the rest up to the source `prefix' are random.  The
+ *     prefix defaults to the range, which defaults to the whole address.
+ */
+static int dns_perf_parse_subnet(const char *s, ecs_subnet_t *e)
+{
+    char   buf[INET6_ADDRSTRLEN + 16], *p, *slash, *end;
+    long   n, bits;
+    int    i;
+
+    if (strlen(s) >= sizeof(buf)) {
+        return -1;
+    }
+
+    strcpy(buf, s);
+    memset(e, 0, sizeof(ecs_subnet_t));
+    e->weight = 1;
+
+    if ((p = strchr(buf, '@')) != NULL) {
+        *p++ = '\0';
+        n = strtol(p, &end, 10);
+        if (*p == '\0' || *end != '\0' || n <= 0 || n > 1000000) {
+            return -1;
+        }
+        e->weight = n;
+    }
+
+    if ((slash = strchr(buf, '/')) != NULL) {
+        *slash++ = '\0';
+    }
+
+    if (inet_pton(AF_INET, buf, e->addr) == 1) {
+        e->family = 1;
+        bits = 32;
+    } else if (inet_pton(AF_INET6, buf, e->addr) == 1) {
+        e->family = 2;
+        bits = 128;
+    } else {
+        return -1;
+    }
+
+    e->range = e->prefix = bits;
+
+    if (slash != NULL) {
+        n = strtol(slash, &end, 10);
+        if (end == slash || (*end != '\0' && *end != '/') || n < 0 || n > bits) {
+            return -1;
+        }
+        e->range = e->prefix = n;
+
+        if (*end == '/') {
+            p = end + 1;
+            n = strtol(p, &end, 10);
+            if (end == p || *end != '\0' || n < e->range || n > bits) {
+                return -1;
+            }
+            e->prefix = n;
+        }
+    }
+
+    /* nothing beyond the range is taken from the address */
+    for (i = e->range; i < bits; i++) {
+        e->addr[i / 8] &= ~(0x80 >> (i % 8));
+    }
+
+    return 0;
+}
+
+/*
+ * dns_perf_add_subnets:
+ *     append the client subnets of -e, a comma separated list.
+ */
+int dns_perf_add_subnets(char *src)
+{
+    ecs_subnet_t  *array;
+    char          *buf, *p, *save;
+    size_t         len;
+
+    if ((buf = strdup(src)) == NULL) {
+        return -1;
+    }
+
+    for (p = strtok_r(buf, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+        array = realloc(g_ecs_array, (g_ecs_number + 1) * sizeof(ecs_subnet_t));
+        if (array == NULL) {
+            free(buf);
+            return -1;
+        }
+
+        g_ecs_array = array;
+
+        if (dns_perf_parse_subnet(p, &array[g_ecs_number]) == -1) {
+            free(buf);
+            return -1;
+        }
+
+        g_ecs_weight_total += array[g_ecs_number].weight;
+        array[g_ecs_number].weight_end = g_ecs_weight_total;
+
+        /* a fresh subnet for every query */
+        if (g_ecs_number > 0
+            || array[g_ecs_number].range < array[g_ecs_number].prefix)
+        {
+            g_ecs_pool = TRUE;
+        }
+
+        g_ecs_number++;
+    }
+
+    free(buf);
+
+    if (g_ecs_number == 0) {
+        return -1;
+    }
+
+    /* all of them, as given, for the report */
+    len = (g_real_client ? strlen(g_real_client) + 1 : 0) + strlen(src) + 1;
+    if ((p = realloc(g_real_client, len)) == NULL) {
+        return -1;
+    }
+
+    if (g_real_client == NULL) {
+        p[0] = '\0';
+    } else {
+        strcat(p, ",");
+    }
+
+    g_real_client = strcat(p, src);
+
+    return 0;
+}
+
+/*
+ * dns_perf_parse_hex:
+ *     decode the hex string `s' into at most `size' bytes.
+ *     Returns the number of bytes or -1.
+ */
+static int dns_perf_parse_hex(const char *s, u_char *buf, int size)
+{
+    int  i, n, c;
+
+    n = strlen(s);
+    if (n % 2 != 0 || n / 2 > size) {
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        c = s[i];
+
+        if (c >= '0' && c <= '9') {
+            c -= '0';
+        } else if (c >= 'a' && c <= 'f') {
+            c -= 'a' - 10;
+        } else if (c >= 'A' && c <= 'F') {
+            c -= 'A' - 10;
+        } else {
+            return -1;
+        }
+
+        if (i % 2 == 0) {
+            buf[i / 2] = c << 4;
+        } else {
+            buf[i / 2] |= c;
+        }
+    }
+
+    return n / 2;
+}
+
+/*
+ * dns_perf_parse_edns:
+ *     the EDNS0 settings of -X, a comma separated list of do,
+ *     bufsize=N, nsid, cookie[=hex], padding=N and opt=code[:hex].
+ */
+int dns_perf_parse_edns(char *src)
+{
+    char    *buf, *p, *v, *save, *end;
+    u_char   data[PACKETSZ];
+    u_char  *opt;
+    int      i, len, room, ret = -1;
+    long     n;
+
+    if ((buf = strdup(src)) == NULL) {
+        return -1;
+    }
+
+    for (p = strtok_r(buf, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+        if ((v = strchr(p, '=')) != NULL) {
+            *v++ = '\0';
+        }
+
+        opt = g_edns_options + g_edns_options_len;
+        room = sizeof(g_edns_options) - g_edns_options_len;
+        len = 0;
+
+        if (strcmp(p, "do") == 0 && v == NULL) {
+            g_edns_flags |= DNS_EDNS_MESSAGEFLAGS_DO;
+
+        } else if (strcmp(p, "bufsize") == 0 && v != NULL) {
+            /* longer answers would not fit in the receive buffers */
+            n = strtol(v, &end, 10);
+            if (*end != '\0' || n < PACKETSZ || n > MAX_RECV_SIZE) {
+                goto finish;
+            }
+            g_edns_udp_size = n;
+
+        } else if (strcmp(p, "nsid") == 0 && v == NULL) {
+            len = dns_perf_message_option(opt, room, DNS_OPTTYPE_NSID, NULL, 0);
+
+        } else if (strcmp(p, "cookie") == 0) {
+            /* a client cookie, optionally followed by a server cookie */
+            if (v != NULL) {
+                n = dns_perf_parse_hex(v, data, 40);
+                if (n != 8 && (n < 16 || n > 40)) {
+                    goto finish;
+                }
+            } else {
+                for (i = 0; i < 8; i++) {
+                    data[i] = random();
+                }
+                n = 8;
+            }
+            len = dns_perf_message_option(opt, room, DNS_OPTTYPE_COOKIE, data, n);
+
+        } else if (strcmp(p, "padding") == 0 && v != NULL) {
+            n = strtol(v, &end, 10);
+            if (*end != '\0' || n <= 0 || n > PACKETSZ) {
+                goto finish;
+            }
+            g_edns_padding = n;
+
+        } else if (strcmp(p, "opt") == 0 && v != NULL) {
+            n = strtol(v, &end, 10);
+            if (end == v || n < 0 || n > 65535 || (*end != '\0' && *end != ':')) {
+                goto finish;
+            }
+
+            len = 0;
+            if (*end == ':' && (len = dns_perf_parse_hex(end + 1, data,
+                                                          sizeof(data))) == -1)
+            {
+                goto finish;
+            }
+            len = dns_perf_message_option(opt, room, n, data, len);
+
+        } else {
+            goto finish;
+        }
+
+        if (len == -1) {
+            goto finish;
+        }
+
+        g_edns_options_len += len;
+    }
+
+    g_edns = TRUE;
+    ret = 0;
+
+finish:
+    free(buf);
+
+    return ret;
+}
+
+/*
+ * dns_perf_parse_port_range:
+ *     the source ports of -x, "low[-high]".
+ */
+int dns_perf_parse_port_range(char *src)
+{
+    char  *end;
+    long   low, high;
+
+    low = strtol(src, &end, 10);
+    high = low;
+
+    if (*end == '-') {
+        high = strtol(end + 1, &end, 10);
+    }
+
+    if (*end != '\0' || low <= 0 || high < low || high > 65535) {
+        return -1;
+    }
+
+    g_source_port_low = low;
+    g_source_port_high = high;
+
+    return 0;
+}
+
 void sig_handler(int signo)
 {
     switch (signo) {
@@ -221,11 +981,28 @@ void sig_handler(int signo)
         g_stop = 1;
         break;
 
+    case SIGHUP:
+        g_reload = 1;
+        break;
+
     default:
         break;
     }
 }
 
+/*
+ * dns_perf_now:
+ *     monotonic clock in microseconds, used to measure round-trip time.
+ */
+uint64_t dns_perf_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 timeval_t dns_perf_timer_sub(timeval_t a, timeval_t b)
 {
     timeval_t ret;
@@ -297,32 +1074,170 @@ int dns_perf_valid_qtype(char *qtype)
 }
 
 
-int dns_perf_parse_args(int argc, char **argv)
+/*
+ * dns_perf_conf_apply:
+ *     settings of the file of -C, applied where -C appears on the command
+ *     line so the options after it win.  `servers', `queryset' and
+ *     `perfset' tell dns_perf_parse_args() what came from the file.
+ */
+static int dns_perf_conf_apply(char *file, int *servers, int *queryset,
+    int *perfset)
 {
-    int queryset, perfset;;
-    int c;
+    conf_t  *cf;
+    char    *p, *last;
+    int      ret = -1;
 
-    while((c = getopt(argc, argv, "d:s:p:t:l:Q:q:i:P:f:T:c:e:vh")) != -1) {
+    if (conf_parse_file(file, &cf) == -1) {
+        return -1;
+    }
 
-        switch (c) {
-        case 'd':
-            if (dns_perf_set_str(&g_data_file_name, optarg) == -1) {
-                fprintf(stderr, "Error setting datafile %s\n", optarg);
-                return -1;
+    if (cf->name_server != NULL) {
+        for (p = strtok_r(cf->name_server, ",", &last); p != NULL;
+             p = strtok_r(NULL, ",", &last))
+        {
+            if (dns_perf_add_server(p) == -1) {
+                fprintf(stderr, "Error setting name_server %s\n", p);
+                goto done;
             }
-            break;
+            *servers = TRUE;
+        }
+    }
 
-        case 's':
-            if (dns_perf_set_str(&g_name_server, optarg) == -1) {
-                fprintf(stderr, "Error setting name_server %s\n", optarg);
-                return -1;
-            }
-            break;
+    if (cf->port != CONF_UNSET) {
+        g_name_server_port = cf->port;
+    }
 
-        case 'p':
-            if (dns_perf_set_uint(&g_name_server_port, optarg) == -1) {
-                fprintf(stderr, "Error setting name_server's port %s\n", optarg);
-                return -1;
+    if (cf->data_file != NULL
+        && dns_perf_set_str(&g_data_file_name, cf->data_file) == -1)
+    {
+        goto done;
+    }
+
+    if (cf->timeout != CONF_UNSET) {
+        g_timeout = cf->timeout;
+    }
+
+    if (cf->max_query != CONF_UNSET) {
+        g_query_number = cf->max_query;
+        *queryset = TRUE;
+    }
+
+    if (cf->concurrent_query != CONF_UNSET) {
+        g_concurrent_query = cf->concurrent_query;
+    }
+
+    if (cf->running_time != CONF_UNSET) {
+        g_perf_time = cf->running_time;
+        *perfset = TRUE;
+    }
+
+    if (cf->rate != CONF_UNSET) {
+        g_rate = cf->rate;
+    }
+
+    if (cf->threads != CONF_UNSET) {
+        if (cf->threads == 0) {
+            fprintf(stderr, "Error setting thread number %u\n", cf->threads);
+            goto done;
+        }
+        g_thread_number = cf->threads;
+    }
+
+    if (cf->sockets != CONF_UNSET) {
+        g_sock_number = cf->sockets;
+    }
+
+    if (cf->protocol != NULL) {
+        if (strcmp(cf->protocol, "udp") == 0) {
+            g_layer4_protocol = UDP;
+        } else if (strcmp(cf->protocol, "tcp") == 0) {
+            g_layer4_protocol = TCP;
+        } else {
+            fprintf(stderr, "Invalid transport protocol: %s\n", cf->protocol);
+            goto done;
+        }
+    }
+
+    if (cf->addr_family != NULL) {
+        if (strcmp(cf->addr_family, "inet") == 0) {
+            g_net_family = AF_INET;
+        } else if (strcmp(cf->addr_family, "inet6") == 0) {
+            g_net_family = AF_INET6;
+        } else {
+            fprintf(stderr, "Invalid address family: %s\n", cf->addr_family);
+            goto done;
+        }
+    }
+
+    if (cf->verbose != CONF_UNSET) {
+        g_report_rcode = cf->verbose;
+    }
+
+    ret = 0;
+
+done:
+    conf_destroy(cf);
+    return ret;
+}
+
+
+int dns_perf_parse_args(int argc, char **argv)
+{
+    int queryset = FALSE, perfset = FALSE;
+    int conf_servers = FALSE, conf_query = FALSE, conf_perf = FALSE;
+    int c;
+    char *end;
+
+    while((c = getopt(argc, argv, "C:d:s:D:a:x:X:p:t:l:Q:q:i:P:f:S:n:B:T:r:m:o:O:w:W:E:c:e:Rvh")) != -1) {
+
+        switch (c) {
+        case 'C':
+            if (dns_perf_set_str(&g_conf_file_name, optarg) == -1
+                || dns_perf_conf_apply(optarg, &conf_servers, &conf_query,
+                                       &conf_perf) == -1)
+            {
+                fprintf(stderr, "Error reading configuration file %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'd':
+            if (dns_perf_set_str(&g_data_file_name, optarg) == -1) {
+                fprintf(stderr, "Error setting datafile %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 's':
+            /* -s after -C replaces the name_server of the file */
+            if (conf_servers) {
+                dns_perf_clear_servers();
+                conf_servers = FALSE;
+            }
+
+            if (dns_perf_add_server(optarg) == -1) {
+                fprintf(stderr, "Error setting name_server %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'D':
+            if (strcmp(optarg, "rr") == 0) {
+                g_distribute = DIST_RR;
+            } else if (strcmp(optarg, "weighted") == 0) {
+                g_distribute = DIST_WEIGHTED;
+            } else if (strcmp(optarg, "hash") == 0) {
+                g_distribute = DIST_HASH;
+            } else {
+                fprintf(stderr, "Invalid server distribution: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'p':
+            if (dns_perf_set_uint(&g_name_server_port, optarg) == -1) {
+                fprintf(stderr, "Error setting name_server's port %s\n", optarg);
+                return -1;
             }
             break;
 
@@ -339,6 +1254,12 @@ int dns_perf_parse_args(int argc, char **argv)
                 return -1;
             }
             perfset = TRUE;
+
+            /* -l after -C replaces the max_query of the file */
+            if (conf_query) {
+                dns_perf_set_uint(&g_query_number, DEFAULT_QUERY_NUM);
+                conf_query = FALSE;
+            }
             break;
 
         case 'Q':
@@ -347,6 +1268,12 @@ int dns_perf_parse_args(int argc, char **argv)
                 return -1;
             }
             queryset = TRUE;
+
+            /* -Q after -C replaces the running_time of the file */
+            if (conf_perf) {
+                g_perf_time = 0;
+                conf_perf = FALSE;
+            }
             break;
 
         case 'c':
@@ -358,7 +1285,7 @@ int dns_perf_parse_args(int argc, char **argv)
 
         case 'i':
             if (dns_perf_set_uint(&g_interval, optarg) == -1) {
-                fprintf(stderr, "Error setting interval number %s\n", optarg);
+                fprintf(stderr, "Error setting report interval %s\n", optarg);
                 return -1;
             }
             break;
@@ -385,13 +1312,131 @@ int dns_perf_parse_args(int argc, char **argv)
             }
             break;
 
+        case 'S':
+            if (dns_perf_set_uint(&g_sock_number, optarg) == -1) {
+                fprintf(stderr, "Error setting socket number %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'n':
+            if (dns_perf_set_uint(&g_thread_number, optarg) == -1
+                || g_thread_number == 0)
+            {
+                fprintf(stderr, "Error setting thread number %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'B':
+            if (dns_perf_set_uint(&g_batch, optarg) == -1
+                || g_batch == 0 || g_batch > MAX_BATCH)
+            {
+                fprintf(stderr, "Error setting batch size %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'T':
+            if (dns_perf_set_uint(&g_rate, optarg) == -1 || g_rate == 0) {
+                fprintf(stderr, "Error setting query rate %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'r':
+            g_replay_speed = strtod(optarg, &end);
+            if (*end != '\0' || !(g_replay_speed > 0)) {
+                fprintf(stderr, "Error setting replay speed %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'm':
+            if (strcmp(optarg, "sequential") == 0) {
+                g_select = SELECT_SEQUENTIAL;
+            } else if (strcmp(optarg, "random") == 0) {
+                g_select = SELECT_RANDOM;
+            } else if (strcmp(optarg, "weighted") == 0) {
+                g_select = SELECT_WEIGHTED;
+            } else {
+                fprintf(stderr, "Invalid query selection: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'E':
+            if (dns_perf_set_event_sys(optarg) == -1
+                || dns_perf_set_str(&g_event_sys_name, optarg) == -1)
+            {
+                fprintf(stderr, "Unsupported event system %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'o':
+            if (dns_perf_set_str(&g_json_file_name, optarg) == -1) {
+                fprintf(stderr, "Error setting json file %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'O':
+            if (dns_perf_set_str(&g_csv_file_name, optarg) == -1) {
+                fprintf(stderr, "Error setting csv file %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'w':
+            if (dns_perf_set_str(&g_capture_file_name, optarg) == -1) {
+                fprintf(stderr, "Error setting capture file %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'W':
+            if (strcmp(optarg, "errors") == 0) {
+                g_capture_errors = TRUE;
+            } else if (dns_perf_set_uint(&g_capture_sample, optarg) == -1
+                       || g_capture_sample == 0)
+            {
+                fprintf(stderr, "Invalid capture sampling: %s\n", optarg);
+                return -1;
+            }
+            break;
+
         case 'e':
-            if (dns_perf_set_str(&g_real_client, optarg) == -1) {
-                fprintf(stderr, "Error setting edns client ip %s\n", optarg);
+            if (dns_perf_add_subnets(optarg) == -1) {
+                fprintf(stderr, "Invalid client subnet %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'a':
+            if (dns_perf_add_sources(optarg) == -1) {
+                fprintf(stderr, "Invalid source address: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'x':
+            if (dns_perf_parse_port_range(optarg) == -1) {
+                fprintf(stderr, "Invalid source port range: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case 'X':
+            if (dns_perf_parse_edns(optarg) == -1) {
+                fprintf(stderr, "Invalid EDNS option: %s\n", optarg);
                 return -1;
             }
             break;
 
+        case 'R':
+            g_tcp_retry = TRUE;
+            break;
 
         case 'v':
             g_report_rcode = TRUE;
@@ -406,6 +1451,9 @@ int dns_perf_parse_args(int argc, char **argv)
         }
     }
 
+    queryset |= conf_query;
+    perfset |= conf_perf;
+
     if (queryset == TRUE && perfset == TRUE) {
         fprintf(stderr, "-Q and -l is exclusive, please set only one\n");
         return -1;
@@ -415,462 +1463,3248 @@ int dns_perf_parse_args(int argc, char **argv)
         g_query_number = 100000000;
     }
 
+    /* the capture is replayed in order, once unless -Q or -l are given */
+    if (g_replay_speed != 0) {
+        if (g_rate != 0) {
+            fprintf(stderr, "-r sends at the captured rate, it can't go with -T\n");
+            return -1;
+        }
+
+        g_select = SELECT_SEQUENTIAL;
+
+        if (queryset == FALSE && perfset == FALSE) {
+            g_query_number = 0;
+        }
+    }
+
+    if (g_concurrent_query < g_thread_number) {
+        fprintf(stderr, "-c must be at least the number of threads\n");
+        return -1;
+    }
+
+    if (g_csv_file_name != NULL && g_interval == 0) {
+        fprintf(stderr, "-O needs an interval set by -i\n");
+        return -1;
+    }
+
+    if (g_capture_file_name == NULL && (g_capture_errors || g_capture_sample != 1)) {
+        fprintf(stderr, "-W needs a capture file set by -w\n");
+        return -1;
+    }
+
+    if (g_tcp_retry && g_layer4_protocol == TCP) {
+        fprintf(stderr, "-R retries UDP queries, it can't go with -P tcp\n");
+        return -1;
+    }
+
     return 0;
 }
 
 
 /*
- * dns_perf_data_array_init:
- *     fill 'g_query_array' with information read from 'g_data_file_handler'
+ * dns_perf_grow:
+ *     make sure `*base' can hold `need' bytes, doubling its size.
  */
-int dns_perf_data_array_init()
+static int dns_perf_grow(void **base, size_t *size, size_t need, size_t initial)
 {
-    FILE    *file;
-    char     buf[1024], domain[255], qtype[10];
-    int      len = 0, qtype_n;
-    data_t  *d;
+    size_t  n;
+    void   *p;
 
-    if (g_data_file_name == NULL) {
+    if (need <= *size) {
+        return 0;
+    }
+
+    for (n = *size ? *size : initial; n < need; n *= 2) {
+        /* void */
+    }
+
+    if ((p = realloc(*base, n)) == NULL) {
+        fprintf(stderr, "Malloc memory error\n");
+        return -1;
+    }
+
+    *base = p;
+    *size = n;
+
+    return 0;
+}
+
+
+/*
+ * dns_perf_template_add:
+ *     append the wire format query of `d' to g_template_arena.
+ */
+static int dns_perf_template_add(data_t *d, const u_char *buf, int len)
+{
+    if (g_template_arena_len + len > UINT_MAX) {
+        fprintf(stderr, "Too many queries in data file\n");
         return -1;
     }
 
+    if (dns_perf_grow((void **) &g_template_arena, &g_template_arena_size,
+                      g_template_arena_len + len, 65536) == -1)
+    {
+        return -1;
+    }
+
+    memcpy(g_template_arena + g_template_arena_len, buf, len);
+    d->tmpl_off = g_template_arena_len;
+    d->tmpl_len = len;
+    g_template_arena_len += len;
+
+    return 0;
+}
+
+
+/*
+ * dns_perf_compile_query:
+ *     encode the query of `d' once into g_template_arena, the send path
+ *     only copies it and patches the message id.
+ */
+static int dns_perf_compile_query(data_t *d, const char *name,
+    const u_char *options, int options_len)
+{
+    u_char  buf[PACKETSZ], padded[PACKETSZ];
+    int     len, pad;
 
-    if ((file = fopen(g_data_file_name, "r")) == NULL) {
+    len = dns_perf_message_build_query(buf, sizeof(buf), name, d->qtype,
+                                       DNS_CLASS_IN, 1);
+    if (len == -1) {
+        fprintf(stderr, "Failed to create query packet: %s %d\n", name,
+                d->qtype);
         return -1;
     }
 
-    /* Calculate how many useful lines */
-    while(fgets(buf, 1024, file) != 0) {
-        if (buf[0] == '#' || buf[0] == '\n') {
-            continue;
+    /* pad the whole message to a multiple of the block size, RFC 8467 */
+    if (options != NULL && g_edns_padding != 0) {
+        pad = len + DNS_OPT_RR_LEN + options_len + DNS_OPTION_LEN(0);
+        pad = (g_edns_padding - pad % g_edns_padding) % g_edns_padding;
+
+        memcpy(padded, options, options_len);
+        pad = dns_perf_message_option(padded + options_len,
+                                      sizeof(padded) - options_len,
+                                      DNS_OPTTYPE_PADDING, NULL, pad);
+        if (pad == -1) {
+            fprintf(stderr, "Failed to pad query packet: %s\n", name);
+            return -1;
         }
 
-        len++;
+        options = padded;
+        options_len += pad;
     }
 
-    if ((g_data_array = calloc(len, sizeof(data_t))) == NULL) {
-        fprintf(stderr, "Malloc memory error");
-        goto finish;
+    if (options != NULL) {
+        len = dns_perf_message_add_opt(buf, len, sizeof(buf), g_edns_udp_size,
+                                       g_edns_flags, options, options_len);
+        if (len == -1) {
+            fprintf(stderr, "Failed to add EDNS to query packet: %s\n", name);
+            return -1;
+        }
     }
 
-    rewind(file);
-    g_data_array_len = 0;
-    while(fgets(buf, 1024, file) != 0) {
-        if (buf[0] == '#' || buf[0] == '\n') {
-            continue;
+    return dns_perf_template_add(d, buf, len);
+}
+
+
+/*
+ * dns_perf_parse_line:
+ *     split one data file line into <domain, qtype [weight]> tokens, the
+ *     weight column is only read when `weight' is not NULL and defaults
+ *     to 1. Returns 0 for blank and comment lines, 1 for a query line
+ *     and -1 on error.
+ */
+static int dns_perf_parse_line(const char *p, const char *last,
+    const char **name, int *name_len, char *qtype, int qtype_size,
+    uint64_t *weight)
+{
+    const char  *s;
+    uint64_t     v;
+
+    while (p < last && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        p++;
+    }
+
+    if (p == last || *p == '#') {
+        return 0;
+    }
+
+    for (s = p; p < last && *p != ' ' && *p != '\t' && *p != '\r'; p++) {
+        /* void */
+    }
+
+    *name = s;
+    *name_len = p - s;
+
+    while (p < last && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+
+    for (s = p; p < last && *p != ' ' && *p != '\t' && *p != '\r'; p++) {
+        /* void */
+    }
+
+    if (p == s || p - s >= qtype_size || *name_len >= MAX_DOMAIN_LEN) {
+        return -1;
+    }
+
+    memcpy(qtype, s, p - s);
+    qtype[p - s] = '\0';
+
+    if (weight == NULL) {
+        return 1;
+    }
+
+    while (p < last && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+
+    if (p == last || *p == '\r') {
+        *weight = 1;
+        return 1;
+    }
+
+    for (v = 0; p < last && *p >= '0' && *p <= '9'; p++) {
+        v = v * 10 + (*p - '0');
+
+        if (v > UINT_MAX) {
+            return -1;
         }
+    }
 
-        if (sscanf(buf, "%s %s", domain, qtype) == EOF) {
-            fprintf(stderr, "Error string in data file:%s\n", buf);
-            goto finish;
+    if (v == 0 || (p < last && *p != ' ' && *p != '\t' && *p != '\r')) {
+        return -1;
+    }
+
+    *weight = v;
+
+    return 1;
+}
+
+
+/*
+ * dns_perf_data_text_init:
+ *     parse the <domain, qtype [weight]> lines of a data file in a single
+ *     pass.
+ */
+static int dns_perf_data_text_init(const char *map, size_t size,
+    const u_char *opt, int options_len)
+{
+    int          lineno = 0, n, name_len, qtype_n;
+    const char  *p, *last, *eol, *s;
+    char         qtype[10], name[MAX_DOMAIN_LEN];
+    size_t       data_size = 0, weight_size = 0;
+    uint64_t     weight;
+    data_t      *d;
+
+    last = map + size;
+
+    for (p = map; p < last; p = eol + 1) {
+        lineno++;
+
+        if ((eol = memchr(p, '\n', last - p)) == NULL) {
+            eol = last;
         }
 
-        if (strlen(domain) > MAX_DOMAIN_LEN) {
-            fprintf(stderr, "Error domain name too long:%s\n", domain);
-            goto finish;
+        n = dns_perf_parse_line(p, eol, &s, &name_len, qtype, sizeof(qtype),
+                                g_select == SELECT_WEIGHTED ? &weight : NULL);
+        if (n == 0) {
+            continue;
+        }
+
+        if (n == -1) {
+            fprintf(stderr, "Error string in data file line %d: %.*s\n",
+                    lineno, (int) (eol - p), p);
+            return -1;
         }
 
         if ((qtype_n = dns_perf_valid_qtype(qtype)) == -1) {
             fprintf(stderr, "Error unknown qtype:%s\n", qtype);
-            goto finish;
+            return -1;
+        }
+
+        if (g_name_arena_len + name_len > UINT_MAX) {
+            fprintf(stderr, "Too many queries in data file\n");
+            return -1;
+        }
+
+        if (dns_perf_grow((void **) &g_data_array, &data_size,
+                          (g_data_array_len + 1) * sizeof(data_t),
+                          4096 * sizeof(data_t)) == -1)
+        {
+            return -1;
+        }
+
+        if (g_select == SELECT_WEIGHTED) {
+            if (dns_perf_grow((void **) &g_weight_array, &weight_size,
+                              (g_data_array_len + 1) * sizeof(uint64_t),
+                              4096 * sizeof(uint64_t)) == -1)
+            {
+                return -1;
+            }
+
+            g_weight_total += weight;
+            g_weight_array[g_data_array_len] = g_weight_total;
         }
 
         d = &g_data_array[g_data_array_len];
-        d->len = strlen(domain);
-        memcpy(d->domain, domain, d->len);
+        d->name_off = g_name_arena_len;
+        d->name_len = name_len;
         d->qtype = qtype_n;
 
+        memcpy(g_name_arena + g_name_arena_len, s, name_len);
+        g_name_arena_len += name_len;
+
+        memcpy(name, s, name_len);
+        name[name_len] = '\0';
+
+        if (dns_perf_compile_query(d, name, opt, options_len) == -1) {
+            return -1;
+        }
+
         g_data_array_len++;
     }
 
- finish:
+    return 0;
+}
 
-    if (fclose(file) != 0) {
+
+/* state of dns_perf_data_capture_init() */
+typedef struct capture_s {
+    size_t        data_size;
+    size_t        time_size;
+    uint64_t      first;         /* usec, of the first query */
+    uint64_t      last;          /* usec, of the latest query */
+    unsigned int  datagrams;
+} capture_t;
+
+/*
+ * dns_perf_capture_query:
+ *     take a UDP payload of the capture if it is a query, it is sent as it
+ *     was captured but for its message id.
+ */
+static int dns_perf_capture_query(void *arg, uint64_t time,
+    const u_char *payload, int len)
+{
+    capture_t  *c = arg;
+    data_t     *d;
+    char        name[MAX_DOMAIN_LEN];
+    int         name_len, qtype;
+
+    c->datagrams++;
+
+    /* responses and anything else which is not a query */
+    if (len > PACKETSZ) {
+        return 0;
+    }
+
+    name_len = dns_perf_message_parse_query(payload, len, name, sizeof(name),
+                                            &qtype);
+    if (name_len == -1) {
+        return 0;
+    }
+
+    if (dns_perf_grow((void **) &g_data_array, &c->data_size,
+                      (g_data_array_len + 1) * sizeof(data_t),
+                      4096 * sizeof(data_t)) == -1)
+    {
+        return -1;
+    }
+
+    d = &g_data_array[g_data_array_len];
+    d->name_off = g_name_arena_len;
+    d->name_len = name_len;
+    d->qtype = qtype;
+
+    memcpy(g_name_arena + g_name_arena_len, name, name_len);
+    g_name_arena_len += name_len;
+
+    if (dns_perf_template_add(d, payload, len) == -1) {
+        return -1;
+    }
+
+    /* templates have message id 0 */
+    g_template_arena[d->tmpl_off] = 0;
+    g_template_arena[d->tmpl_off + 1] = 0;
+
+    if (g_replay_speed != 0) {
+        if (dns_perf_grow((void **) &g_replay_time, &c->time_size,
+                          (g_data_array_len + 1) * sizeof(uint64_t),
+                          4096 * sizeof(uint64_t)) == -1)
+        {
+            return -1;
+        }
+
+        if (g_data_array_len == 0) {
+            c->first = c->last = time;
+        }
+
+        /* packets of several interfaces may be out of order a little */
+        if (time < c->last) {
+            time = c->last;
+        }
+
+        c->last = time;
+        g_replay_time[g_data_array_len] = time - c->first;
+    }
+
+    g_data_array_len++;
+
+    return 0;
+}
+
+/*
+ * dns_perf_data_capture_init:
+ *     take the queries of a pcap or pcapng data file, in capture order.
+ */
+static int dns_perf_data_capture_init(const u_char *map, size_t size)
+{
+    capture_t  c;
+
+    if (g_ecs_number != 0 || g_edns) {
+        fprintf(stderr, "Captured queries are sent as they are, -e and -X "
+                "can't be used with them\n");
+        return -1;
+    }
+
+    if (g_select == SELECT_WEIGHTED) {
+        fprintf(stderr, "Captured queries have no weight, -m weighted can't "
+                "be used with them\n");
+        return -1;
+    }
+
+    memset(&c, 0, sizeof(capture_t));
+
+    if (dns_perf_pcap_walk(map, size, dns_perf_capture_query, &c) == -1) {
+        fprintf(stderr, "Error reading capture %s\n", g_data_file_name);
+        return -1;
+    }
+
+    if (g_data_array_len == 0) {
+        return 0;
+    }
+
+    /* the next pass starts one average gap after the last query */
+    if (g_replay_speed != 0) {
+        g_replay_span = c.last - c.first;
+        if (g_data_array_len > 1) {
+            g_replay_span += g_replay_span / (g_data_array_len - 1);
+        }
+
+        if (g_replay_span == 0) {
+            g_replay_span = 1;
+        }
+    }
+
+    printf("[Status] Read %d queries out of %u UDP datagrams of capture %s\n",
+           g_data_array_len, c.datagrams, g_data_file_name);
+
+    return 0;
+}
+
+
+/*
+ * dns_perf_data_array_init:
+ *     map the data file and parse it, a text file of <domain, qtype> lines
+ *     or a pcap or pcapng capture. Domains are kept in g_name_arena and
+ *     every entry is compiled into its wire format query.
+ */
+int dns_perf_data_array_init()
+{
+    int          fd, ret = -1, i, capture;
+    struct stat  st;
+    char        *map, *p;
+    u_char       options[PACKETSZ], *opt = NULL;
+    int          options_len = 0;
+    ecs_subnet_t *e;
+
+    if (g_data_file_name == NULL) {
+        return -1;
+    }
+
+    if (g_ecs_number != 0) {
+        /*
+         * With pools the templates carry the longest client subnet, the
+         * one of each query is put in its place when it's sent.
+         */
+        e = g_ecs_array;
+        for (i = 1; i < g_ecs_number; i++) {
+            if (g_ecs_array[i].prefix > e->prefix) {
+                e = &g_ecs_array[i];
+            }
+        }
+
+        options_len = dns_perf_message_ecs_option(options, sizeof(options),
+                                                  e->family, e->prefix,
+                                                  e->addr);
+        g_ecs_slot_len = 2 + options_len;
+        opt = options;
+
+        if (g_ecs_pool && g_edns_padding != 0) {
+            fprintf(stderr, "Padding can't be used with client subnet pools\n");
+            return -1;
+        }
+    }
+
+    /* the options of -X follow the client subnet */
+    if (g_edns) {
+        if (options_len + g_edns_options_len > sizeof(options)) {
+            fprintf(stderr, "Too many EDNS options\n");
+            return -1;
+        }
+
+        memcpy(options + options_len, g_edns_options, g_edns_options_len);
+        options_len += g_edns_options_len;
+        opt = options;
+    }
+
+    if ((fd = open(g_data_file_name, O_RDONLY)) == -1) {
+        fprintf(stderr, "Open data file %s error: %s\n", g_data_file_name,
+                strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        fprintf(stderr, "Error no query in data file %s\n", g_data_file_name);
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Map data file %s error: %s\n", g_data_file_name,
+                strerror(errno));
+        return -1;
+    }
+
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    /* names never take more room than the file itself */
+    if ((g_name_arena = malloc(st.st_size)) == NULL) {
+        fprintf(stderr, "Malloc memory error\n");
+        goto finish;
+    }
+
+    g_data_array_len = 0;
+    capture = dns_perf_pcap_check((u_char *) map, st.st_size);
+
+    if (g_replay_speed != 0 && !capture) {
+        fprintf(stderr, "-r replays the timing of a capture, %s is not a pcap "
+                "or pcapng file\n", g_data_file_name);
+        goto finish;
+    }
+
+    if (capture) {
+        if (dns_perf_data_capture_init((u_char *) map, st.st_size) == -1) {
+            goto finish;
+        }
+
+    } else if (dns_perf_data_text_init(map, st.st_size, opt, options_len)
+               == -1)
+    {
+        goto finish;
+    }
+
+    if (g_data_array_len == 0) {
+        fprintf(stderr, "Error no query in data file %s\n", g_data_file_name);
+        goto finish;
+    }
+
+    /* give back what comments and qtypes took */
+    if ((p = realloc(g_name_arena, g_name_arena_len)) != NULL) {
+        g_name_arena = p;
+    }
+
+    /* -r: one pass over the capture unless -Q or -l say otherwise */
+    if (g_query_number == 0) {
+        g_query_number = g_data_array_len;
+    }
+
+    ret = 0;
+
+ finish:
+
+    munmap(map, st.st_size);
+
+    if (ret == -1) {
         free(g_data_array);
+        g_data_array = NULL;
+        free(g_name_arena);
+        g_name_arena = NULL;
+        free(g_weight_array);
+        g_weight_array = NULL;
+        free(g_replay_time);
+        g_replay_time = NULL;
+    }
+
+    return ret;
+}
+
+/*
+ * dns_perf_random:
+ *     xorshift64*, per worker so that threads never share a lock as
+ *     random() does.
+ */
+static inline uint64_t dns_perf_random(worker_t *w)
+{
+    w->rand ^= w->rand >> 12;
+    w->rand ^= w->rand << 25;
+    w->rand ^= w->rand >> 27;
+
+    return w->rand * 0x2545f4914f6cdd1dULL;
+}
+
+
+/*
+ * dns_perf_select_data:
+ *     pick the entry of g_data_array the next query of `w' asks for.
+ */
+static data_t *dns_perf_select_data(worker_t *w)
+{
+    unsigned int  i, lo, hi, mid;
+    uint64_t      r;
+
+    switch (g_select) {
+    case SELECT_SEQUENTIAL:
+        i = w->next_data;
+
+        w->next_data += g_thread_number;
+        if (w->next_data >= g_data_array_len) {
+            w->replay_round += w->next_data / g_data_array_len;
+            w->next_data %= g_data_array_len;
+        }
+        break;
+
+    case SELECT_WEIGHTED:
+        /* first entry whose running sum exceeds r */
+        r = dns_perf_random(w) % g_weight_total;
+
+        for (lo = 0, hi = g_data_array_len - 1; lo < hi; ) {
+            mid = lo + (hi - lo) / 2;
+
+            if (g_weight_array[mid] > r) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+
+        i = lo;
+        break;
+
+    default:
+        i = dns_perf_random(w) % g_data_array_len;
+        break;
+    }
+
+    return &g_data_array[i];
+}
+
+
+/*
+ * dns_perf_select_server:
+ *     pick the server of g_server_array which is asked for `d'.
+ */
+static server_t *dns_perf_select_server(worker_t *w, data_t *d)
+{
+    unsigned int   i, lo, hi, mid;
+    uint64_t       r;
+    uint32_t       h;
+    unsigned char *p, *end, c;
+
+    if (g_server_number == 1) {
+        return g_server_array;
+    }
+
+    switch (g_distribute) {
+    case DIST_WEIGHTED:
+    case DIST_HASH:
+        if (g_distribute == DIST_WEIGHTED) {
+            r = dns_perf_random(w) % g_server_weight_total;
+
+        } else {
+            /* FNV-1a of the lowercased name, so a name sticks to a server */
+            h = 2166136261U;
+            p = (unsigned char *) g_name_arena + d->name_off;
+            for (end = p + d->name_len; p < end; p++) {
+                c = (*p >= 'A' && *p <= 'Z') ? *p + ('a' - 'A') : *p;
+                h = (h ^ c) * 16777619U;
+            }
+            r = h % g_server_weight_total;
+        }
+
+        for (lo = 0, hi = g_server_number - 1; lo < hi; ) {
+            mid = lo + (hi - lo) / 2;
+
+            if (g_server_array[mid].weight_end > r) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+
+        i = lo;
+        break;
+
+    default:
+        i = w->server_next++ % g_server_number;
+        break;
+    }
+
+    return &g_server_array[i];
+}
+
+
+/*
+ * dns_perf_select_subnet:
+ *     draw the client subnet of the next query of `w' from the pools of
+ *     -e, by their weights, and encode it into `e'.
+ */
+static void dns_perf_select_subnet(worker_t *w, ecs_wire_t *e)
+{
+    ecs_subnet_t  *s;
+    u_char         addr[16], mask;
+    uint64_t       r;
+    unsigned int   i, lo, hi, mid;
+    int            len;
+
+    r = dns_perf_random(w) % g_ecs_weight_total;
+
+    for (lo = 0, hi = g_ecs_number - 1; lo < hi; ) {
+        mid = lo + (hi - lo) / 2;
+
+        if (g_ecs_array[mid].weight_end > r) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    s = &g_ecs_array[lo];
+    memcpy(addr, s->addr, sizeof(addr));
+
+    /* random bits from the range on, those beyond the prefix are cleared */
+    for (i = s->range / 8; i < (s->prefix + 7) / 8; i++) {
+        if ((i - s->range / 8) % 8 == 0) {
+            r = dns_perf_random(w);
+        }
+
+        mask = (i == s->range / 8) ? 0xff >> (s->range % 8) : 0xff;
+        addr[i] = (addr[i] & ~mask) | (r & mask);
+        r >>= 8;
+    }
+
+    len = dns_perf_message_ecs_option(e->wire + 2, sizeof(e->wire) - 2,
+                                      s->family, s->prefix, addr);
+
+    e->wire[0] = (len + g_edns_options_len) >> 8;    /* OPT RDLEN */
+    e->wire[1] = (len + g_edns_options_len) & 0xff;
+    e->len = 2 + len;
+}
+
+
+/*
+ * dns_perf_select_source:
+ *     the local address the next socket of `w' to a server of `family' is
+ *     bound to.  Sockets walk through every address of -a, then through
+ *     every port of -x, so each one has a 4-tuple of its own as long as
+ *     there are enough of them.  Returns 0 if the kernel is to pick.
+ */
+static int dns_perf_select_source(worker_t *w, int family,
+    dns_perf_addr_t *local)
+{
+    static dns_perf_source_t  any[2] = {
+        { AF_INET,  { 0 }, 0, 1 },
+        { AF_INET6, { 0 }, 0, 1 }
+    };
+    dns_perf_source_t        *src;
+    uint64_t                  n, total, o;
+    unsigned int              i, port;
+    int                       v6 = (family == AF_INET6);
+
+    if (g_source_number == 0 && g_source_port_low == 0) {
+        return 0;
+    }
+
+    /* workers take turns, so no two of them use the same source */
+    n = w->source_next;
+    w->source_next += g_thread_number;
+
+    total = g_source_number ? g_source_total[v6] : 1;
+    o = n % total;
+    src = &any[v6];
+
+    for (i = 0; i < g_source_number; i++) {
+        if (g_source_array[i].family != family) {
+            continue;
+        }
+
+        if (o < g_source_array[i].count) {
+            src = &g_source_array[i];
+            break;
+        }
+
+        o -= g_source_array[i].count;
+    }
+
+    port = 0;
+    if (g_source_port_low != 0) {
+        port = g_source_port_low
+               + (n / total) % (g_source_port_high - g_source_port_low + 1);
+    }
+
+    dns_perf_source_addr(src, o, port, local);
+
+    return 1;
+}
+
+
+/*
+ * dns_perf_generate_query:
+ *     only the message id of a query is its own, the rest is sent from
+ *     its precompiled template.
+ */
+int dns_perf_generate_query(query_t *q)
+{
+    q->id_wire[0] = q->id >> 8;
+    q->id_wire[1] = q->id & 0xff;
+
+    return 0;
+}
+
+/*
+ * dns_perf_query_iov:
+ *     point at most QUERY_IOV iovecs at the wire format of `q', its length
+ *     is stored in `len'.  Returns the number of iovecs.
+ */
+static int dns_perf_query_iov(query_t *q, struct iovec *iov, int *len)
+{
+    data_t      *d = q->data;
+    ecs_wire_t  *e;
+    u_char      *t = g_template_arena + d->tmpl_off;
+    int          head, tail;
+
+    iov[0].iov_base = q->id_wire;
+    iov[0].iov_len = 2;
+
+    if (!g_ecs_pool) {
+        iov[1].iov_base = t + 2;
+        iov[1].iov_len = d->tmpl_len - 2;
+
+        *len = d->tmpl_len;
+        return 2;
+    }
+
+    /* the RDLEN and client subnet of the query replace the template's */
+    e = &q->sock->worker->ecs_array[q - q->sock->worker->query_array];
+    tail = g_edns_options_len;
+    head = d->tmpl_len - tail - g_ecs_slot_len;
+
+    iov[1].iov_base = t + 2;
+    iov[1].iov_len = head - 2;
+    iov[2].iov_base = e->wire;
+    iov[2].iov_len = e->len;
+    iov[3].iov_base = t + d->tmpl_len - tail;
+    iov[3].iov_len = tail;
+
+    *len = head + e->len + tail;
+    return tail ? 4 : 3;
+}
+
+/*
+ * dns_perf_query_wire:
+ *     copy the wire format of `q' to `buf', returns its length.
+ */
+static int dns_perf_query_wire(query_t *q, u_char *buf)
+{
+    struct iovec  iov[QUERY_IOV];
+    int           i, n, len;
+
+    n = dns_perf_query_iov(q, iov, &len);
+
+    for (i = 0; i < n; i++) {
+        memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+        buf += iov[i].iov_len;
+    }
+
+    return len;
+}
+
+
+/*
+ * dns_perf_server_stats:
+ *     the statistics `sock's worker keeps of the server of `sock'.
+ */
+static stats_t *dns_perf_server_stats(sock_t *sock)
+{
+    return &sock->worker->server_stats[sock->server - g_server_array];
+}
+
+
+static void dns_perf_stats_response(stats_t *st, query_t *q,
+    dns_perf_response_t *r, uint64_t now)
+{
+    int  rcode = r->flags & DNS_HEADER_RCODE_MASK;
+
+    st->recv_number++;
+
+    dns_perf_histogram_record(&st->latency, now - q->send_time);
+
+    if (q->retry_time != 0) {
+        st->retry_recv_number++;
+        dns_perf_histogram_record(&st->udp_latency,
+                                  q->retry_time - q->send_time);
+        dns_perf_histogram_record(&st->tcp_latency, now - q->retry_time);
+        dns_perf_histogram_record(&st->retry_latency, now - q->send_time);
+    }
+
+    if (r->flags & DNS_HEADER_FLAG_TC) {
+        st->truncated_number++;
+    } else if (rcode == DNS_RCODE_NOERROR && r->ancount == 0) {
+        st->empty_number++;
+    }
+
+    switch(rcode) {
+    case 0:
+        st->success_number++;
+        break;
+
+    case 1:
+        st->formerr_number++;
+        break;
+
+    case 2:
+        st->serverr_number++;
+        break;
+
+    case 3:
+        st->nxdomain_number++;
+        break;
+
+    case 4:
+        st->notimp_number++;
+        break;
+
+    case 5:
+        st->refuse_number++;
+        break;
+
+    default:
+        st->other_number++;
+        break;
+    }
+}
+
+
+int dns_perf_query_process_response(query_t *q, dns_perf_response_t *r)
+{
+    uint64_t  now = dns_perf_now();
+
+    dns_perf_stats_response(&q->sock->worker->stats, q, r, now);
+    dns_perf_stats_response(dns_perf_server_stats(q->sock), q, r, now);
+
+    return 0;
+}
+
+
+/*
+ * dns_perf_capture_addr:
+ *     the addresses of a query sent on `sock'.
+ */
+static void dns_perf_capture_addr(sock_t *sock, dns_perf_pcap_udp_t *u)
+{
+    struct sockaddr_storage  *ss = &sock->server->addr.ss;
+    struct sockaddr_storage  *local = &sock->local.ss;
+
+    memset(u, 0, sizeof(dns_perf_pcap_udp_t));
+    u->family = ss->ss_family;
+
+    if (u->family == AF_INET6) {
+        memcpy(u->dst, &((struct sockaddr_in6 *) ss)->sin6_addr, 16);
+        u->dport = ntohs(((struct sockaddr_in6 *) ss)->sin6_port);
+    } else {
+        memcpy(u->dst, &((struct sockaddr_in *) ss)->sin_addr, 4);
+        u->dport = ntohs(((struct sockaddr_in *) ss)->sin_port);
+    }
+
+    if (local->ss_family != u->family) {
+        return;
+    }
+
+    if (u->family == AF_INET6) {
+        memcpy(u->src, &((struct sockaddr_in6 *) local)->sin6_addr, 16);
+        u->sport = ntohs(((struct sockaddr_in6 *) local)->sin6_port);
+    } else {
+        memcpy(u->src, &((struct sockaddr_in *) local)->sin_addr, 4);
+        u->sport = ntohs(((struct sockaddr_in *) local)->sin_port);
+    }
+}
+
+/*
+ * dns_perf_capture:
+ *     record the query `q' sent on `sock' and its response `buf', NULL when
+ *     it timed out, in the capture ring of the worker if they are sampled.
+ *     `q' is NULL for a response no query is waiting for.  Nothing here
+ *     waits for the capture thread, when the ring is full the packets are
+ *     dropped and counted.
+ */
+static void dns_perf_capture(sock_t *sock, query_t *q, const u_char *buf,
+    int len, int error)
+{
+    worker_t             *w = sock->worker;
+    capture_slot_t       *s, *r;
+    dns_perf_pcap_udp_t   addr;
+    unsigned int          head, tail, n;
+
+    if (g_capture_errors) {
+        if (!error) {
+            return;
+        }
+
+    } else if (--w->capture_next != 0) {
+        return;
+
+    } else {
+        w->capture_next = g_capture_sample;
+    }
+
+    n = (q != NULL) + (buf != NULL);
+    head = w->capture_head;
+    tail = __atomic_load_n(&w->capture_tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail + n > CAPTURE_RING_SIZE) {
+        w->capture_dropped += n;
+        return;
+    }
+
+    dns_perf_capture_addr(sock, &addr);
+
+    if (q != NULL) {
+        s = &w->capture_ring[head++ % CAPTURE_RING_SIZE];
+        s->time = q->send_time;
+        s->len = dns_perf_query_wire(q, s->data);
+        s->caplen = s->len;
+        s->addr = addr;
+    }
+
+    if (buf != NULL) {
+        r = &w->capture_ring[head++ % CAPTURE_RING_SIZE];
+        r->time = dns_perf_now();
+        r->len = len;
+        r->caplen = len < CAPTURE_SNAPLEN ? len : CAPTURE_SNAPLEN;
+        memcpy(r->data, buf, r->caplen);
+
+        r->addr.family = addr.family;
+        memcpy(r->addr.src, addr.dst, 16);
+        memcpy(r->addr.dst, addr.src, 16);
+        r->addr.sport = addr.dport;
+        r->addr.dport = addr.sport;
+    }
+
+    __atomic_store_n(&w->capture_head, head, __ATOMIC_RELEASE);
+}
+
+
+static int dns_perf_sock_send(void *arg);
+static int dns_perf_sock_recv(void *arg);
+static int dns_perf_sock_flush(sock_t *sock);
+static void dns_perf_sock_close(sock_t *sock);
+static void dns_perf_sock_reset(sock_t *sock);
+static int dns_perf_sock_flush_tcp(sock_t *sock);
+static int dns_perf_sock_recv_tcp(sock_t *sock);
+
+static int dns_perf_sock_open(sock_t *sock)
+{
+    dns_perf_addr_t  local, *lp;
+    int              i;
+
+    for (i = 0; i < SOURCE_TRIES; i++) {
+        lp = dns_perf_select_source(sock->worker,
+                                    sock->server->addr.ss.ss_family, &local)
+             ? &local : NULL;
+
+        if (sock->tcp) {
+            sock->fd = dns_perf_open_tcp_socket(&sock->server->addr, lp);
+        } else {
+            sock->fd = dns_perf_open_udp_socket(&sock->server->addr, lp,
+                                                sock->ephemeral
+                                                ? DEFAULT_BUF_SIZE
+                                                : POOL_BUF_SIZE);
+        }
+
+        /* try the next source if this one is still taken */
+        if (sock->fd != -1 || lp == NULL
+            || (errno != EADDRINUSE && errno != EADDRNOTAVAIL))
+        {
+            break;
+        }
+    }
+
+    if (sock->fd == -1) {
+        if (i == SOURCE_TRIES) {
+            fprintf(stderr, "Error no free source address or port\n");
+
+        /* -R: a failed retry is reported once by dns_perf_query_retry() */
+        } else if (!(sock->tcp && g_tcp_retry)) {
+            fprintf(stderr, "Error open %s socket: %s\n",
+                    sock->tcp ? "tcp" : "udp", strerror(errno));
+        }
+        return -1;
+    }
+
+    /* the source address of the packets written by -w */
+    if (g_capture_file != NULL) {
+        sock->local.len = sizeof(sock->local.ss);
+
+        if (getsockname(sock->fd, (struct sockaddr *) &sock->local.ss,
+                        &sock->local.len) == -1)
+        {
+            sock->local.ss.ss_family = AF_UNSPEC;
+        }
+    }
+
+    /* pooled UDP sockets are served by completions where possible */
+    sock->completion = (!sock->tcp && !sock->ephemeral
+                        && dns_perf_eventsys_completion()
+                        && dns_perf_eventsys_recv_start(sock->fd, sock) == 0);
+
+    if (sock->completion) {
+        return 0;
+    }
+
+    if (dns_perf_eventsys_set_fd(sock->fd, MOD_RD, sock) == -1) {
+        fprintf(stderr, "Error set read fd:%d\n", sock->fd);
+        close(sock->fd);
+        sock->fd = -1;
+        return -1;
+    }
+
+    if (!sock->tcp) {
+        return 0;
+    }
+
+    /* wait for connect() to complete before writing anything */
+    sock->connecting = 1;
+    sock->rlen = sock->wlen = 0;
+
+    if (dns_perf_eventsys_set_fd(sock->fd, MOD_WR, sock) == -1) {
+        fprintf(stderr, "Error set write fd:%d\n", sock->fd);
+        dns_perf_sock_close(sock);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void dns_perf_sock_close(sock_t *sock)
+{
+    if (sock->fd == -1) {
+        return;
+    }
+
+    if (LINK_LINKED(sock, flink)) {
+        LIST_UNLINK(sock->worker->flush_list, sock, flink);
+    }
+
+    dns_perf_eventsys_del_fd(sock->fd);
+
+    close(sock->fd);
+    sock->fd = -1;
+}
+
+/*
+ * dns_perf_query_attach:
+ *     bind an unused query to a socket of `server' and give it a message id
+ *     which is not outstanding on that socket.
+ */
+static int dns_perf_query_attach(worker_t *w, query_t *q, server_t *server,
+    int retry)
+{
+    sock_t       *sock, *array;
+    unsigned int  i, *next;
+
+    array = retry ? w->retry_array : w->sock_array;
+    next = retry ? &w->retry_next : &w->sock_next;
+
+    if (w->sock_number == 0) {
+        sock = &array[q - w->query_array];
+        sock->server = server;
+
+        if (dns_perf_sock_open(sock) == -1) {
+            return -1;
+        }
+
+        q->id = sock->next_id++;
+        sock->query = q;
+
+    } else {
+        /* server s owns sockets [s * sock_number, (s + 1) * sock_number) */
+        array += (server - g_server_array) * w->sock_number;
+
+        for (i = 0; i < w->sock_number; i++) {
+            sock = &array[(*next)++ % w->sock_number];
+
+            /* reconnect a persistent connection closed by the server */
+            if (sock->fd == -1 && dns_perf_sock_open(sock) == -1) {
+                continue;
+            }
+
+            if (sock->outstanding < MAX_SOCK_QUERIES) {
+                break;
+            }
+        }
+
+        if (sock->fd == -1 || sock->outstanding >= MAX_SOCK_QUERIES) {
+            return -1;
+        }
+
+        while (sock->ids[sock->next_id] != NULL) {
+            sock->next_id++;
+        }
+
+        q->id = sock->next_id++;
+        sock->ids[q->id] = q;
+    }
+
+    sock->outstanding++;
+    q->sock = sock;
+
+    return 0;
+}
+
+/*
+ * dns_perf_sock_release:
+ *     forget the query of message id `id', closing an ephemeral socket.
+ */
+static void dns_perf_sock_release(sock_t *sock, int id)
+{
+    if (sock->ephemeral) {
+        sock->query = NULL;
+        dns_perf_sock_close(sock);
+    } else {
+        sock->ids[id] = NULL;
+    }
+
+    sock->outstanding--;
+}
+
+/*
+ * dns_perf_query_release:
+ *     detach a query from its socket, closing the socket if it's ephemeral,
+ *     and put it back on the free list.  Nothing is counted.
+ */
+static void dns_perf_query_release(query_t *q)
+{
+    sock_t  *sock = q->sock;
+
+    if (q->state == F_UNUSED) {
+        return;
+    }
+
+    if (q->state == F_SENDING) {
+        LIST_UNLINK(sock->pending, q, link);
+    }
+
+    dns_perf_timer_del(&sock->worker->timers, &q->timer);
+
+    dns_perf_sock_release(sock, q->id);
+    q->sock = NULL;
+    q->state = F_UNUSED;
+
+    LIST_PREPEND(sock->worker->free_list, q, link);
+    sock->worker->busy--;
+}
+
+/*
+ * dns_perf_query_finish:
+ *     release a query, counting it lost if it never got its response.
+ */
+static void dns_perf_query_finish(query_t *q)
+{
+    if (q->state != F_UNUSED && q->state != F_DONE) {
+        q->sock->worker->stats.lost_number++;
+        dns_perf_server_stats(q->sock)->lost_number++;
+    }
+
+    dns_perf_query_release(q);
+}
+
+static query_t *dns_perf_sock_find_query(sock_t *sock, unsigned short id)
+{
+    if (sock->ephemeral) {
+        return sock->query;
+    }
+
+    return sock->ids[id];
+}
+
+
+/*
+ * dns_perf_query_send:
+ *     queue a query on its socket, the socket is flushed in batches by
+ *     dns_perf_worker_flush() once the worker has queued all it can.
+ *     The timeout runs from now, q->send_time is left to the caller.
+ */
+int dns_perf_query_send(query_t *q)
+{
+    sock_t    *sock = q->sock;
+    worker_t  *w = sock->worker;
+
+    q->state = F_SENDING;
+    LIST_APPEND(sock->pending, q, link);
+
+    dns_perf_timer_add(&w->timers, &q->timer, dns_perf_now() + w->timeout * 1000);
+
+    /* a socket waiting to become writable is flushed by dns_perf_sock_send */
+    if (!LINK_LINKED(sock, flink)
+        && !dns_perf_eventsys_is_fdset(sock->fd, MOD_WR))
+    {
+        LIST_APPEND(w->flush_list, sock, flink);
+    }
+
+    return 0;
+}
+
+/*
+ * dns_perf_sock_flush:
+ *     send the pending queries of a socket, up to g_batch datagrams per
+ *     system call.
+ */
+static int dns_perf_sock_flush(sock_t *sock)
+{
+    int           i, n, ret, len;
+    worker_t     *w = sock->worker;
+    query_t      *q;
+    struct iovec  iov[QUERY_IOV];
+    struct msghdr *msg;
+
+    if (sock->tcp) {
+        return dns_perf_sock_flush_tcp(sock);
+    }
+
+    if (sock->completion) {
+        /* queued as requests, submitted together with the next wait */
+        while ((q = LIST_HEAD(sock->pending)) != NULL) {
+            n = dns_perf_query_iov(q, iov, &len);
+
+            if (dns_perf_eventsys_send(sock->fd, iov, n) == -1) {
+                dns_perf_query_finish(q);
+                continue;
+            }
+
+            LIST_UNLINK(sock->pending, q, link);
+            q->state = F_READING;
+        }
+
+        return 0;
+    }
+
+    while (!LIST_EMPTY(sock->pending)) {
+
+        n = 0;
+        for (q = LIST_HEAD(sock->pending); q != NULL && n < g_batch;
+             q = LIST_NEXT(q, link))
+        {
+            msg = &w->msgs[n].msg_hdr;
+            memset(msg, 0, sizeof(struct msghdr));
+            msg->msg_iov = &w->iovs[QUERY_IOV * n];
+            msg->msg_iovlen = dns_perf_query_iov(q, msg->msg_iov, &len);
+            n++;
+        }
+
+#ifdef HAVE_SENDMMSG
+        ret = sendmmsg(sock->fd, w->msgs, n, 0);
+#else
+        for (ret = 0; ret < n; ret++) {
+            if (sendmsg(sock->fd, &w->msgs[ret].msg_hdr, 0) < 0) {
+                break;
+            }
+        }
+
+        if (ret == 0) {
+            ret = -1;
+        }
+#endif
+
+        if (ret < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                if (dns_perf_eventsys_set_fd(sock->fd, MOD_WR, sock) == -1) {
+                    fprintf(stderr, "Error set write fd:%d\n", sock->fd);
+                    return -1;
+                }
+                return 0;
+            }
+
+            /* the first datagram failed, drop it and go on with the rest */
+            dns_perf_query_finish(LIST_HEAD(sock->pending));
+
+            if (sock->fd == -1) {
+                return 0;
+            }
+            continue;
+        }
+
+        for (i = 0; i < ret; i++) {
+            q = LIST_HEAD(sock->pending);
+            LIST_UNLINK(sock->pending, q, link);
+            q->state = F_READING;
+        }
+    }
+
+    return 0;
+}
+
+static void dns_perf_worker_flush(worker_t *w)
+{
+    sock_t  *sock;
+
+    while ((sock = LIST_HEAD(w->flush_list)) != NULL) {
+        LIST_UNLINK(w->flush_list, sock, flink);
+        dns_perf_sock_flush(sock);
+    }
+}
+
+/*
+ * dns_perf_sock_send:
+ *     socket became writable, flush the queries waiting for it.
+ */
+static int dns_perf_sock_send(void *arg)
+{
+    sock_t  *sock = arg;
+
+    if (sock->connecting) {
+        if (dns_perf_socket_state(sock->fd) != 0) {
+            dns_perf_sock_reset(sock);
+            return 0;
+        }
+
+        sock->connecting = 0;
+    }
+
+    return dns_perf_sock_flush(sock);
+}
+
+/*
+ * dns_perf_query_retry:
+ *     -R: the UDP answer of `q' is truncated, ask the same question again
+ *     over TCP as a stub resolver would.  The query keeps its send_time,
+ *     its latency covers both legs.
+ */
+static void dns_perf_query_retry(query_t *q)
+{
+    sock_t    *udp = q->sock;
+    worker_t  *w = udp->worker;
+    int        id = q->id;
+    stats_t   *sst = dns_perf_server_stats(udp);
+
+    if (dns_perf_query_attach(w, q, udp->server, 1) == -1) {
+        if (w->retry_failed++ == 0) {
+            fprintf(stderr, "Error no TCP connection to retry truncated "
+                    "queries on, they count as lost: %s\n", strerror(errno));
+        }
+
+        dns_perf_query_finish(q);
+        return;
+    }
+
+    dns_perf_sock_release(udp, id);
+    dns_perf_timer_del(&w->timers, &q->timer);
+    dns_perf_generate_query(q);
+
+    q->retry_time = dns_perf_now();
+    dns_perf_query_send(q);
+
+    w->stats.retry_number++;
+    sst->retry_number++;
+}
+
+/*
+ * dns_perf_sock_response:
+ *     validate one response and dispatch it to its query by message id.
+ *     A malformed or mismatched response is counted and dropped, its
+ *     query keeps waiting for the real one.
+ *     Returns -1 if the socket has been closed meanwhile.
+ */
+static int dns_perf_sock_response(sock_t *sock, u_char *buf, int len)
+{
+    dns_perf_response_t  r;
+    stats_t             *st = &sock->worker->stats;
+    stats_t             *sst = dns_perf_server_stats(sock);
+    query_t             *q;
+    int                  ret;
+
+    if (dns_perf_message_parse_response(buf, len, &r) != DNS_RESPONSE_OK) {
+        st->malformed_number++;
+        sst->malformed_number++;
+
+        /* -w: keep it, with its query if the message id still tells */
+        if (g_capture_file != NULL) {
+            q = NULL;
+
+            if (len >= 2) {
+                q = dns_perf_sock_find_query(sock, buf[0] << 8 | buf[1]);
+            }
+
+            if (q != NULL && q->state != F_READING) {
+                q = NULL;
+            }
+
+            dns_perf_capture(sock, q, buf, len, 1);
+        }
+
+        return 0;
+    }
+
+    q = dns_perf_sock_find_query(sock, r.id);
+    if (q == NULL || q->state != F_READING) {
+        return 0;  /* late response of a timed out query */
+    }
+
+    ret = dns_perf_message_check_question(buf, len,
+                                          g_template_arena + q->data->tmpl_off);
+    if (ret != DNS_RESPONSE_OK) {
+        if (ret == DNS_RESPONSE_MISMATCH) {
+            st->mismatch_number++;
+            sst->mismatch_number++;
+        } else {
+            st->malformed_number++;
+            sst->malformed_number++;
+        }
+
+        if (g_capture_file != NULL) {
+            dns_perf_capture(sock, q, buf, len, 1);
+        }
+
+        return 0;
+    }
+
+    if ((r.flags & DNS_HEADER_FLAG_TC) && g_tcp_retry && !sock->tcp) {
+        st->truncated_number++;
+        sst->truncated_number++;
+        dns_perf_query_retry(q);
+
+        return sock->fd == -1 ? -1 : 0;
+    }
+
+    if (dns_perf_query_process_response(q, &r) == -1) {
+        return 0;
+    }
+
+    if (g_capture_file != NULL) {
+        dns_perf_capture(sock, q, buf, len,
+                         (r.flags & DNS_HEADER_RCODE_MASK) != DNS_RCODE_NOERROR);
+    }
+
+    q->state = F_DONE;
+    dns_perf_query_finish(q);
+
+    return sock->fd == -1 ? -1 : 0;
+}
+
+/*
+ * dns_perf_sock_reset:
+ *     a connection failed or was closed by the server, give up all the
+ *     queries outstanding on it.  A persistent connection is reopened by
+ *     dns_perf_query_attach() when it's needed again.
+ */
+static void dns_perf_sock_reset(sock_t *sock)
+{
+    int  id;
+
+    if (sock->ephemeral) {
+        if (sock->query != NULL) {
+            dns_perf_query_finish(sock->query);
+        }
+
+    } else {
+        for (id = 0; id < MAX_SOCK_QUERIES && sock->outstanding > 0; id++) {
+            if (sock->ids[id] != NULL) {
+                dns_perf_query_finish(sock->ids[id]);
+            }
+        }
+    }
+
+    dns_perf_sock_close(sock);
+}
+
+/*
+ * dns_perf_sock_flush_tcp:
+ *     write the pending queries of a connection, each one prefixed by its
+ *     2 bytes length (RFC 1035 4.2.2), as many of them as fit in one
+ *     writev().  Responses may come back in any order (RFC 7766).
+ */
+static int dns_perf_sock_flush_tcp(sock_t *sock)
+{
+    int           i, k, n, ret, len;
+    worker_t     *w = sock->worker;
+    query_t      *q;
+    u_char        msg[PACKETSZ + 2];
+    struct iovec  iov[QUERY_IOV];
+
+    while (sock->wlen > 0 || !LIST_EMPTY(sock->pending)) {
+
+        n = 0;
+
+        /* the unwritten tail of a message goes first */
+        if (sock->wlen > 0) {
+            w->iovs[n].iov_base = sock->wbuf;
+            w->iovs[n].iov_len = sock->wlen;
+            n++;
+        }
+
+        i = 0;
+        for (q = LIST_HEAD(sock->pending); q != NULL && i < g_batch;
+             q = LIST_NEXT(q, link))
+        {
+            k = dns_perf_query_iov(q, &w->iovs[n + 1], &len);
+
+            w->lens[i][0] = len >> 8;
+            w->lens[i][1] = len & 0xff;
+
+            w->iovs[n].iov_base = w->lens[i];
+            w->iovs[n].iov_len = 2;
+            n += 1 + k;
+
+            i++;
+        }
+
+        ret = writev(sock->fd, w->iovs, n);
+        if (ret < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                if (dns_perf_eventsys_set_fd(sock->fd, MOD_WR, sock) == -1) {
+                    fprintf(stderr, "Error set write fd:%d\n", sock->fd);
+                    return -1;
+                }
+                return 0;
+            }
+
+            dns_perf_sock_reset(sock);
+            return 0;
+        }
+
+        if (sock->wlen > 0) {
+            if (ret < sock->wlen) {
+                memmove(sock->wbuf, sock->wbuf + ret, sock->wlen - ret);
+                sock->wlen -= ret;
+                continue;
+            }
+
+            ret -= sock->wlen;
+            sock->wlen = 0;
+        }
+
+        /*
+         * Queries written completely or partially are waiting for their
+         * responses now, the rest of a partially written one is kept by
+         * the socket so the query itself may time out in the meantime.
+         */
+        while (ret > 0) {
+            q = LIST_HEAD(sock->pending);
+            LIST_UNLINK(sock->pending, q, link);
+            q->state = F_READING;
+
+            dns_perf_query_iov(q, iov, &len);
+            len += 2;
+
+            if (ret >= len) {
+                ret -= len;
+                continue;
+            }
+
+            msg[0] = (len - 2) >> 8;
+            msg[1] = (len - 2) & 0xff;
+            dns_perf_query_wire(q, msg + 2);
+
+            memcpy(sock->wbuf, msg + ret, len - ret);
+            sock->wlen = len - ret;
+
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static int dns_perf_sock_grow_rbuf(sock_t *sock, int size)
+{
+    u_char  *p;
+
+    if ((p = realloc(sock->rbuf, size)) == NULL) {
+        fprintf(stderr, "Error memory low");
+        return -1;
+    }
+
+    sock->rbuf = p;
+    sock->rsize = size;
+
+    return 0;
+}
+
+/*
+ * dns_perf_sock_recv_tcp:
+ *     read the stream of a connection and dispatch every complete
+ *     length-prefixed response in it, an incomplete one is kept in rbuf
+ *     until the rest of it arrives. Returns 1 if it stopped before the
+ *     stream was drained.
+ */
+static int dns_perf_sock_recv_tcp(sock_t *sock)
+{
+    int     ret, len, pos, room, n;
+    u_char *p;
+
+    for (n = 0; n < MAX_RECV_LOOP; n++) {
+
+        room = sock->rsize - sock->rlen;
+        ret = recv(sock->fd, sock->rbuf + sock->rlen, room, 0);
+
+        if (ret < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                break;
+            }
+
+            dns_perf_sock_reset(sock);
+            return 0;
+        }
+
+        if (ret == 0) {  /* closed by the server */
+            dns_perf_sock_reset(sock);
+            return 0;
+        }
+
+        sock->rlen += ret;
+
+        for (pos = 0; sock->rlen - pos >= 2; pos += len + 2) {
+            p = sock->rbuf + pos;
+            len = p[0] << 8 | p[1];
+
+            if (sock->rlen - pos < len + 2) {
+                /* make room for a response longer than rbuf */
+                if (len + 2 > sock->rsize
+                    && dns_perf_sock_grow_rbuf(sock, len + 2) == -1)
+                {
+                    dns_perf_sock_reset(sock);
+                    return 0;
+                }
+                break;
+            }
+
+            if (dns_perf_sock_response(sock, p + 2, len) == -1) {
+                return 0;
+            }
+        }
+
+        if (pos > 0) {
+            memmove(sock->rbuf, sock->rbuf + pos, sock->rlen - pos);
+            sock->rlen -= pos;
+        }
+
+        if (ret < room) {
+            break;
+        }
+    }
+
+    if (dns_perf_eventsys_set_fd(sock->fd, MOD_RD, sock) == -1) {
+        fprintf(stderr, "Error set read fd:%d\n", sock->fd);
+    }
+
+    return n >= MAX_RECV_LOOP;
+}
+
+
+/*
+ * dns_perf_sock_recv:
+ *     socket became readable, read responses (up to g_batch datagrams per
+ *     system call) and dispatch them to the queries by message id.
+ */
+static int dns_perf_sock_recv(void *arg)
+{
+    int        ret, i, n;
+    sock_t    *sock = arg;
+    worker_t  *w = sock->worker;
+
+    if (sock->tcp) {
+        return dns_perf_sock_recv_tcp(sock);
+    }
+
+    for (n = 0; n < MAX_RECV_LOOP; n += ret) {
+
+#ifdef HAVE_SENDMMSG
+        for (i = 0; i < g_batch; i++) {
+            w->iovs[i].iov_base = w->recv_buf[i];
+            w->iovs[i].iov_len = MAX_RECV_SIZE;
+            memset(&w->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+            w->msgs[i].msg_hdr.msg_iov = &w->iovs[i];
+            w->msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        ret = recvmmsg(sock->fd, w->msgs, g_batch, 0, NULL);
+#else
+        ret = recv(sock->fd, w->recv_buf[0], MAX_RECV_SIZE, 0);
+        if (ret >= 0) {
+            w->msgs[0].msg_len = ret;
+            ret = 1;
+        }
+#endif
+
+        if (ret < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                break;
+            }
+
+            /* e.g. ICMP port unreachable reported on a connected socket */
+            if (sock->ephemeral && sock->query != NULL) {
+                dns_perf_query_finish(sock->query);
+                return 0;
+            }
+
+            ret = 1;
+            continue;
+        }
+
+        for (i = 0; i < ret; i++) {
+            if (dns_perf_sock_response(sock, w->recv_buf[i],
+                                       w->msgs[i].msg_len) == -1)
+            {
+                return 0;
+            }
+        }
+
+        if (ret < g_batch) {
+            break;
+        }
+    }
+
+    if (dns_perf_eventsys_set_fd(sock->fd, MOD_RD, sock) == -1) {
+        fprintf(stderr, "Error set read fd:%d\n", sock->fd);
+    }
+
+    /* with an edge triggered event system the rest needs another call */
+    return n >= MAX_RECV_LOOP;
+}
+
+
+/*
+ * dns_perf_sock_recv_data:
+ *     a response the event system has read for the socket.
+ */
+static int dns_perf_sock_recv_data(void *arg, u_char *buf, int len)
+{
+    return dns_perf_sock_response(arg, buf, len);
+}
+
+
+/*
+ * dns_perf_query_timeout:
+ *     timer handler of a query which got no response in time.
+ */
+static void dns_perf_query_timeout(dns_perf_timer_t *t)
+{
+    query_t  *q = (query_t *) ((char *) t - offsetof(query_t, timer));
+
+    if (g_capture_file != NULL) {
+        dns_perf_capture(q->sock, q, NULL, 0, 1);
+    }
+
+    dns_perf_query_finish(q);
+}
+
+
+/*
+ * dns_perf_share:
+ *     the part of `total' which belongs to the worker `index'.
+ */
+static unsigned int dns_perf_share(unsigned int total, int index)
+{
+    return total / g_thread_number + (index < total % g_thread_number);
+}
+
+
+static void dns_perf_stats_init(stats_t *s)
+{
+    memset(s, 0, sizeof(stats_t));
+
+    dns_perf_histogram_init(&s->latency);
+    dns_perf_histogram_init(&s->udp_latency);
+    dns_perf_histogram_init(&s->tcp_latency);
+    dns_perf_histogram_init(&s->retry_latency);
+}
+
+
+/*
+ * dns_perf_sock_array:
+ *     allocate the w->sock_array_len sockets of a worker, they are opened
+ *     when they are needed first.
+ */
+static sock_t *dns_perf_sock_array(worker_t *w, int tcp)
+{
+    sock_t  *array, *sock;
+    int      i;
+
+    array = calloc(w->sock_array_len, sizeof(sock_t));
+    if (array == NULL) {
+        fprintf(stderr, "Error memory low");
+        return NULL;
+    }
+
+    for (i = 0; i < w->sock_array_len; i++) {
+
+        sock = &array[i];
+
+        sock->ops.send = dns_perf_sock_send;
+        sock->ops.recv = dns_perf_sock_recv;
+        sock->ops.recv_data = dns_perf_sock_recv_data;
+        sock->fd = -1;
+        sock->worker = w;
+        sock->ephemeral = (w->sock_number == 0);
+        sock->next_id = random();
+        sock->tcp = tcp;
+        LIST_INIT(sock->pending);
+        LINK_INIT(sock, flink);
+
+        if (sock->tcp) {
+            sock->rsize = TCP_RBUF_SIZE;
+            sock->rbuf = malloc(sock->rsize);
+            sock->wbuf = malloc(PACKETSZ + 2);
+
+            if (sock->rbuf == NULL || sock->wbuf == NULL) {
+                fprintf(stderr, "Error memory low");
+                return NULL;
+            }
+        }
+
+        if (sock->ephemeral) {
+            continue;
+        }
+
+        sock->server = &g_server_array[i / w->sock_number];
+        sock->ids = calloc(MAX_SOCK_QUERIES, sizeof(query_t *));
+        if (sock->ids == NULL) {
+            fprintf(stderr, "Error memory low");
+            return NULL;
+        }
+    }
+
+    return array;
+}
+
+
+/*
+ * dns_perf_prepare:
+ *     Do some preparation before quering.
+ *   1. allocate query_array of the worker
+ *   2. allocate sock_array of the worker, pooled sockets are opened later
+ *      by dns_perf_open_sockets() once the event system is ready
+ */
+static int dns_perf_prepare(worker_t *w)
+{
+    query_t    *q;
+    int         i;
+
+    w->query_array_len = dns_perf_share(g_concurrent_query, w->index);
+    w->query_number = dns_perf_share(g_query_number, w->index);
+
+    LIST_INIT(w->flush_list);
+    LIST_INIT(w->free_list);
+    dns_perf_stats_init(&w->stats);
+    pthread_mutex_init(&w->report_lock, NULL);
+
+    w->query_array = calloc(w->query_array_len, sizeof(query_t));
+    if (w->query_array == NULL) {
+        fprintf(stderr, "Error memory low");
+        return -1;
+    }
+
+    /* workers interleave their sequential passes over the data file */
+    w->next_data = w->index % g_data_array_len;
+    w->source_next = w->index;
+    w->rand = dns_perf_now() ^ ((uint64_t) (w->index + 1) << 32) ^ 0x9e3779b97f4a7c15ULL;
+
+    for (i = 0; i < w->query_array_len; i++) {
+        q = &w->query_array[i];
+
+        q->data = NULL;
+        q->id = -1;
+        q->sock = NULL;
+        q->state = F_UNUSED;
+        LINK_INIT(q, link);
+        dns_perf_timer_init(&q->timer, dns_perf_query_timeout);
+
+        LIST_APPEND(w->free_list, q, link);
+    }
+
+    if (g_sock_number == 0) {
+        w->sock_number = 0;
+        w->sock_array_len = w->query_array_len;
+
+    } else {
+        /* every worker owns at least one socket */
+        w->sock_number = dns_perf_share(g_sock_number, w->index);
+        if (w->sock_number == 0) {
+            w->sock_number = 1;
+        }
+
+        if ((unsigned long) w->sock_number * MAX_SOCK_QUERIES < w->query_array_len) {
+            fprintf(stderr, "Error %d sockets can't carry %d concurrent queries\n",
+                    w->sock_number, w->query_array_len);
+            return -1;
+        }
+
+        w->sock_array_len = w->sock_number * g_server_number;
+    }
+
+    w->server_stats = calloc(g_server_number, sizeof(stats_t));
+    if (w->server_stats == NULL) {
+        fprintf(stderr, "Error memory low");
+        return -1;
+    }
+
+    for (i = 0; i < g_server_number; i++) {
+        dns_perf_stats_init(&w->server_stats[i]);
+    }
+
+    if (g_ecs_pool) {
+        w->ecs_array = calloc(w->query_array_len, sizeof(ecs_wire_t));
+        if (w->ecs_array == NULL) {
+            fprintf(stderr, "Error memory low");
+            return -1;
+        }
+    }
+
+    if (g_capture_file != NULL) {
+        w->capture_ring = malloc(CAPTURE_RING_SIZE * sizeof(capture_slot_t));
+        if (w->capture_ring == NULL) {
+            fprintf(stderr, "Error memory low");
+            return -1;
+        }
+
+        /* fault the pages in now, not while sending */
+        memset(w->capture_ring, 0, CAPTURE_RING_SIZE * sizeof(capture_slot_t));
+
+        w->capture_next = g_capture_sample;
+    }
+
+    if ((w->sock_array = dns_perf_sock_array(w, g_layer4_protocol == TCP))
+        == NULL)
+    {
+        return -1;
+    }
+
+    /* -R: the TCP connections truncated queries are asked again on */
+    if (g_tcp_retry && (w->retry_array = dns_perf_sock_array(w, 1)) == NULL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int dns_perf_open_sockets(worker_t *w)
+{
+    int  i;
+
+    if (w->sock_number == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < w->sock_array_len; i++) {
+        if (dns_perf_sock_open(&w->sock_array[i]) == -1) {
+            fprintf(stderr, "Error create socket failed\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * dns_perf_query_start:
+ *     build a free query and queue it to be sent, `send_time' is when it
+ *     was due, latency is measured from then.
+ */
+static int dns_perf_query_start(worker_t *w, query_t *q, uint64_t send_time)
+{
+    LIST_UNLINK(w->free_list, q, link);
+
+    q->data = dns_perf_select_data(w);
+
+    if (g_ecs_pool) {
+        dns_perf_select_subnet(w, &w->ecs_array[q - w->query_array]);
+    }
+
+    if (dns_perf_query_attach(w, q, dns_perf_select_server(w, q->data), 0)
+        == -1)
+    {
+        LIST_PREPEND(w->free_list, q, link);
+        return -1;
+    }
+
+    w->busy++;
+    q->state = F_CONNECTING;
+
+    if (dns_perf_generate_query(q) != 0) {
+        dns_perf_query_finish(q);
         return -1;
     }
 
-    return 0;
+    /* send query to remote name server */
+    q->send_time = send_time;
+    q->retry_time = 0;
+    if (dns_perf_query_send(q) == -1) {
+        return 0;
+    }
+
+    w->stats.send_number++;
+    dns_perf_server_stats(q->sock)->send_number++;
+
+    return 0;
+}
+
+
+/*
+ * dns_perf_replay_due:
+ *     usec, when the next query of `w' was sent in the capture.
+ */
+static double dns_perf_replay_due(worker_t *w)
+{
+    return w->replay_start
+           + (w->replay_round * g_replay_span + g_replay_time[w->next_data])
+             / g_replay_speed;
+}
+
+/*
+ * Whip query_t to make it as busy as possible.
+ *
+ * Closed loop (default): every free query is sent at once.
+ * Open loop (-T): queries are sent on a fixed schedule whatever the
+ * responses do, a query due while none is free is skipped and counted.
+ * Replay (-r): likewise, on the schedule of the capture.
+ * Either way no more than query_limit queries are in flight.
+ */
+static int dns_perf_whip_query(worker_t *w)
+{
+    query_t  *q;
+    uint64_t  now;
+
+    now = dns_perf_now();
+
+    if (g_rate == 0 && g_replay_speed == 0) {
+        while (w->stats.send_number < w->query_number
+               && w->busy < w->query_limit
+               && (q = LIST_HEAD(w->free_list)) != NULL)
+        {
+            if (dns_perf_query_start(w, q, now) == -1) {
+                return -1;
+            }
+        }
+
+    } else {
+        while (w->next_send <= now && w->stats.send_number < w->query_number) {
+
+            if (w->busy >= w->query_limit
+                || (q = LIST_HEAD(w->free_list)) == NULL)
+            {
+                w->stats.skip_number++;
+
+                if (g_replay_speed != 0) {
+                    dns_perf_select_data(w);
+                }
+
+            } else if (dns_perf_query_start(w, q, (uint64_t) w->next_send) == -1) {
+                return -1;
+            }
+
+            if (g_replay_speed != 0) {
+                w->next_send = dns_perf_replay_due(w);
+            } else {
+                w->next_send += w->send_interval;
+            }
+        }
+    }
+
+    dns_perf_worker_flush(w);
+
+    return 0;
+}
+
+
+/*
+ * dns_perf_worker_timeout:
+ *     how long the event loop may sleep in milliseconds.  When the next
+ *     query is due in less than 1ms, the loop only polls so the schedule
+ *     of -T is kept with sub-millisecond precision.
+ */
+static long dns_perf_worker_timeout(worker_t *w)
+{
+    uint64_t  now;
+    long      timeout, due;
+
+    now = dns_perf_now();
+    timeout = dns_perf_timer_next(&w->timers, now, w->timeout);
+
+    if (g_rate != 0 || g_replay_speed != 0) {
+        due = w->next_send > now ? (long) ((w->next_send - now) / 1000) : 0;
+        if (due < timeout) {
+            timeout = due;
+        }
+    }
+
+    /* wake up in time to publish the interval statistics */
+    if (g_interval != 0 && timeout > REPORT_WAKEUP) {
+        timeout = REPORT_WAKEUP;
+    }
+
+    return timeout;
+}
+
+
+static void dns_perf_sock_array_free(worker_t *w, sock_t *array)
+{
+    int  i;
+
+    if (array == NULL) {
+        return;
+    }
+
+    for (i = 0; i < w->sock_array_len; i++) {
+        dns_perf_sock_close(&array[i]);
+        free(array[i].ids);
+        free(array[i].rbuf);
+        free(array[i].wbuf);
+    }
+}
+
+static int dns_perf_clear_query(worker_t *w)
+{
+    int  i;
+
+    for (i = 0; i < w->query_array_len; i++) {
+        /* queries still in flight at the end are drained, not lost */
+        dns_perf_query_release(&w->query_array[i]);
+    }
+
+    dns_perf_sock_array_free(w, w->sock_array);
+    dns_perf_sock_array_free(w, w->retry_array);
+
+    return 0;
+}
+
+
+/*
+ * dns_perf_worker_report:
+ *     publish the statistics of `w' to the reporter thread.
+ */
+static void dns_perf_worker_report(worker_t *w, int finished)
+{
+    unsigned int  seq = g_report_seq;
+
+    pthread_mutex_lock(&w->report_lock);
+
+    w->report = w->stats;
+    w->report_seq = seq;
+    w->finished = finished;
+
+    pthread_mutex_unlock(&w->report_lock);
+}
+
+
+/*
+ * dns_perf_conf_reload:
+ *     read the file of -C again and take the rate, the concurrency and the
+ *     timeout from it.  Nothing changes if any of them is not acceptable.
+ *     Called with g_conf_lock held.
+ */
+static void dns_perf_conf_reload()
+{
+    conf_t        *cf;
+    unsigned int   rate, concurrent, timeout;
+
+    if (g_conf_file_name == NULL) {
+        fprintf(stderr, "SIGHUP ignored, no configuration file given by -C\n");
+        return;
+    }
+
+    if (conf_parse_file(g_conf_file_name, &cf) == -1) {
+        fprintf(stderr, "Reloading %s failed, settings kept\n", g_conf_file_name);
+        return;
+    }
+
+    rate = g_rate;
+    concurrent = g_concurrent_query;
+    timeout = g_timeout;
+
+    if (cf->rate != CONF_UNSET && cf->rate != g_rate) {
+        if (g_rate == 0 || cf->rate == 0) {
+            fprintf(stderr, "Reload: the rate can only be changed in open "
+                    "loop, settings kept\n");
+            goto done;
+        }
+        rate = cf->rate;
+    }
+
+    if (cf->concurrent_query != CONF_UNSET) {
+        if (cf->concurrent_query < g_thread_number
+            || cf->concurrent_query > g_concurrent_limit)
+        {
+            fprintf(stderr, "Reload: concurrent_query must be between %u and "
+                    "%u, settings kept\n", g_thread_number, g_concurrent_limit);
+            goto done;
+        }
+        concurrent = cf->concurrent_query;
+    }
+
+    if (cf->timeout != CONF_UNSET) {
+        if (cf->timeout == 0) {
+            fprintf(stderr, "Reload: timeout must not be 0, settings kept\n");
+            goto done;
+        }
+        timeout = cf->timeout;
+    }
+
+    g_rate = rate;
+    g_concurrent_query = concurrent;
+    g_timeout = timeout;
+    g_conf_seq++;
+
+    if (g_rate != 0) {
+        printf("[Status] Reloaded %s: rate %u, concurrent queries %u, "
+               "timeout %u ms\n", g_conf_file_name, g_rate, g_concurrent_query,
+               g_timeout);
+    } else {
+        printf("[Status] Reloaded %s: concurrent queries %u, timeout %u ms\n",
+               g_conf_file_name, g_concurrent_query, g_timeout);
+    }
+
+done:
+    conf_destroy(cf);
+}
+
+static void dns_perf_conf_check()
+{
+    pthread_mutex_lock(&g_conf_lock);
+
+    if (g_reload) {
+        g_reload = 0;
+        dns_perf_conf_reload();
+    }
+
+    pthread_mutex_unlock(&g_conf_lock);
+}
+
+
+/*
+ * dns_perf_worker_conf:
+ *     take the live settings.  Queries in flight keep their timeout, a
+ *     lower concurrency only holds back new queries until enough return.
+ */
+static void dns_perf_worker_conf(worker_t *w)
+{
+    unsigned int  rate, concurrent;
+
+    pthread_mutex_lock(&g_conf_lock);
+
+    w->conf_seq = g_conf_seq;
+    w->timeout = g_timeout;
+    rate = g_rate;
+    concurrent = g_concurrent_query;
+
+    pthread_mutex_unlock(&g_conf_lock);
+
+    w->query_limit = dns_perf_share(concurrent, w->index);
+    if (w->query_limit > w->query_array_len) {
+        w->query_limit = w->query_array_len;
+    }
+
+    if (rate != 0) {
+        w->send_interval = 1000000.0 * g_thread_number / rate;
+    }
+}
+
+
+/*
+ * dns_perf_worker_run:
+ *     event loop of one worker, each worker has its own event system.
+ */
+static void *dns_perf_worker_run(void *arg)
+{
+    worker_t  *w = arg;
+    timeval_t  now, age;
+
+    w->ret = -1;
+
+    if (dns_perf_eventsys_init() == -1) {
+        return NULL;
+    }
+
+    if (dns_perf_timer_wheel_init(&w->timers, TIMER_TICK,
+                                  (uint64_t) g_timeout * 1000, dns_perf_now()) == -1)
+    {
+        fprintf(stderr, "Error memory low");
+        dns_perf_eventsys_destroy();
+        return NULL;
+    }
+
+    /* how long can you live */
+    age = dns_perf_timer_add_long(g_query_start, g_perf_time * 1000000);
+
+    if (dns_perf_open_sockets(w) == -1) {
+        goto done;
+    }
+
+    dns_perf_worker_conf(w);
+
+    if (g_rate != 0) {
+        w->next_send = dns_perf_now();
+
+    } else if (g_replay_speed != 0) {
+        w->replay_start = dns_perf_now();
+        w->next_send = dns_perf_replay_due(w);
+    }
+
+    if (dns_perf_whip_query(w) == -1) {
+        goto done;
+    }
+
+    while (g_stop == 0) {
+        dns_perf_eventsys_dispatch(dns_perf_worker_timeout(w));
+
+        dns_perf_timer_expire(&w->timers, dns_perf_now());
+
+        if (w->report_seq != g_report_seq) {
+            dns_perf_worker_report(w, 0);
+        }
+
+        if (g_reload) {
+            dns_perf_conf_check();
+        }
+
+        if (w->conf_seq != g_conf_seq) {
+            dns_perf_worker_conf(w);
+        }
+
+        /* Is time up? */
+        if (g_perf_time != 0) {
+            gettimeofday(&now, NULL);
+            if (dns_perf_timer_cmp(now, age) > 0) {
+                if (w->index == 0) {
+                    printf("time up\n");
+                }
+                break;
+            }
+        }
+
+        /* Is query number overflowed? */
+        if (w->stats.send_number >= w->query_number) {
+            break;
+        }
+
+        dns_perf_whip_query(w);
+    }
+
+    w->ret = 0;
+
+ done:
+    dns_perf_clear_query(w);
+
+    if (g_interval != 0) {
+        dns_perf_worker_report(w, 1);
+    }
+
+    dns_perf_timer_wheel_destroy(&w->timers);
+
+    dns_perf_eventsys_destroy();
+
+    return NULL;
+}
+
+
+static void dns_perf_stats_merge(stats_t *dst, stats_t *src)
+{
+    dst->send_number += src->send_number;
+    dst->recv_number += src->recv_number;
+    dst->success_number += src->success_number;
+    dst->formerr_number += src->formerr_number;
+    dst->serverr_number += src->serverr_number;
+    dst->nxdomain_number += src->nxdomain_number;
+    dst->notimp_number += src->notimp_number;
+    dst->refuse_number += src->refuse_number;
+    dst->other_number += src->other_number;
+    dst->skip_number += src->skip_number;
+    dst->lost_number += src->lost_number;
+    dst->truncated_number += src->truncated_number;
+    dst->empty_number += src->empty_number;
+    dst->mismatch_number += src->mismatch_number;
+    dst->malformed_number += src->malformed_number;
+    dst->retry_number += src->retry_number;
+    dst->retry_recv_number += src->retry_recv_number;
+
+    dns_perf_histogram_merge(&dst->latency, &src->latency);
+    dns_perf_histogram_merge(&dst->udp_latency, &src->udp_latency);
+    dns_perf_histogram_merge(&dst->tcp_latency, &src->tcp_latency);
+    dns_perf_histogram_merge(&dst->retry_latency, &src->retry_latency);
+}
+
+
+/*
+ * dns_perf_stats_sub:
+ *     what happened between the snapshots `src' and `dst'.
+ */
+static void dns_perf_stats_sub(stats_t *dst, stats_t *src)
+{
+    dst->send_number -= src->send_number;
+    dst->recv_number -= src->recv_number;
+    dst->success_number -= src->success_number;
+    dst->formerr_number -= src->formerr_number;
+    dst->serverr_number -= src->serverr_number;
+    dst->nxdomain_number -= src->nxdomain_number;
+    dst->notimp_number -= src->notimp_number;
+    dst->refuse_number -= src->refuse_number;
+    dst->other_number -= src->other_number;
+    dst->skip_number -= src->skip_number;
+    dst->lost_number -= src->lost_number;
+    dst->truncated_number -= src->truncated_number;
+    dst->empty_number -= src->empty_number;
+    dst->mismatch_number -= src->mismatch_number;
+    dst->malformed_number -= src->malformed_number;
+    dst->retry_number -= src->retry_number;
+    dst->retry_recv_number -= src->retry_recv_number;
+
+    dns_perf_histogram_sub(&dst->latency, &src->latency);
+    dns_perf_histogram_sub(&dst->udp_latency, &src->udp_latency);
+    dns_perf_histogram_sub(&dst->tcp_latency, &src->tcp_latency);
+    dns_perf_histogram_sub(&dst->retry_latency, &src->retry_latency);
+}
+
+
+/*
+ * dns_perf_report_interval:
+ *     print one line for what happened during the last interval, `span'
+ *     seconds up to `elapsed' seconds into the run.
+ */
+static void dns_perf_report_interval(double elapsed, double span, stats_t *s)
+{
+    dns_perf_histogram_t  *h = &s->latency;
+    unsigned int           lost = s->lost_number;
+    timeval_t              now;
+
+    if (g_csv_file != NULL) {
+        gettimeofday(&now, NULL);
+
+        fprintf(g_csv_file,
+                "%ld.%06ld,%.10g,%u,%u,%.1f,%u,%u,%" PRIu64 ",%" PRIu64 ",%" PRIu64
+                ",%" PRIu64 ",%" PRIu64 ",%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u\n",
+                (long) now.tv_sec, (long) now.tv_usec, elapsed,
+                s->send_number, s->recv_number,
+                (double) s->send_number / span,
+                lost, s->skip_number,
+                dns_perf_histogram_percentile(h, 50),
+                dns_perf_histogram_percentile(h, 90),
+                dns_perf_histogram_percentile(h, 99),
+                dns_perf_histogram_percentile(h, 99.9),
+                h->count ? h->max : 0,
+                s->success_number, s->formerr_number, s->serverr_number,
+                s->nxdomain_number, s->notimp_number, s->refuse_number,
+                s->other_number, s->truncated_number, s->empty_number,
+                s->mismatch_number, s->malformed_number, s->retry_number,
+                s->retry_recv_number);
+
+        fflush(g_csv_file);
+    }
+
+    printf("[Interval]%.10gs sent %u recv %u qps %.1f loss %.2f%%",
+           elapsed, s->send_number, s->recv_number,
+           (double) s->send_number / span,
+           lost ? lost * 100.0 / (s->recv_number + lost) : 0.0);
+
+    if (g_rate != 0 || g_replay_speed != 0) {
+        printf(" skip %u", s->skip_number);
+    }
+
+    printf(" p50 %.3f p90 %.3f p99 %.3f max %.3f ms",
+           dns_perf_histogram_percentile(h, 50) / 1000.0,
+           dns_perf_histogram_percentile(h, 90) / 1000.0,
+           dns_perf_histogram_percentile(h, 99) / 1000.0,
+           h->count ? h->max / 1000.0 : 0.0);
+
+    printf(" noerror %u formerr %u servfail %u nxdomain %u notimp %u"
+           " refused %u other %u",
+           s->success_number, s->formerr_number, s->serverr_number,
+           s->nxdomain_number, s->notimp_number, s->refuse_number,
+           s->other_number);
+
+    printf(" truncated %u empty %u mismatch %u malformed %u",
+           s->truncated_number, s->empty_number, s->mismatch_number,
+           s->malformed_number);
+
+    if (g_tcp_retry) {
+        printf(" retry %u answered %u", s->retry_number, s->retry_recv_number);
+    }
+
+    printf("\n");
+
+    fflush(stdout);
+}
+
+
+/*
+ * dns_perf_capture_run:
+ *     thread writing the capture rings of the workers to the file of -w,
+ *     until g_capture_quit is set and the rings are empty.
+ */
+static void *dns_perf_capture_run(void *arg)
+{
+    worker_t         *w;
+    capture_slot_t   *s;
+    struct timespec   ts;
+    uint64_t          epoch;
+    unsigned int      head, tail;
+    int               i, n, quit;
+
+    /* dns_perf_now() is monotonic, the file wants the time of day */
+    clock_gettime(CLOCK_REALTIME, &ts);
+    epoch = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - dns_perf_now();
+
+    do {
+        quit = g_capture_quit;
+        n = 0;
+
+        for (i = 0; i < g_thread_number; i++) {
+            w = &g_worker_array[i];
+            head = __atomic_load_n(&w->capture_head, __ATOMIC_ACQUIRE);
+
+            for (tail = w->capture_tail; tail != head; tail++, n++) {
+                s = &w->capture_ring[tail % CAPTURE_RING_SIZE];
+
+                if (!g_capture_failed
+                    && dns_perf_pcap_write_udp(g_capture_file, epoch + s->time,
+                                               &s->addr, s->data, s->caplen,
+                                               s->len) == -1)
+                {
+                    g_capture_failed = 1;
+                }
+
+                __atomic_store_n(&w->capture_tail, tail + 1, __ATOMIC_RELEASE);
+            }
+        }
+
+        g_capture_written += n;
+
+        if (n == 0 && !quit) {
+            usleep(CAPTURE_WAKEUP * 1000);
+        }
+
+    } while (!quit);
+
+    return NULL;
 }
 
+
 /*
- * Do I need write description to this file? I don't think so.
+ * dns_perf_report_collect:
+ *     `total' of the last reports of the workers, less `last'.
  */
-int dns_perf_generate_query(query_t *q)
+static void dns_perf_report_collect(stats_t *total, stats_t *last)
 {
-    static unsigned short query_id = 0;
-    int                   len;
-    unsigned short        net_id;
-    u_char                 *p, *t;
-    HEADER               *hp;
-    in_addr_t             addr;
-
-
-    len = res_mkquery(QUERY, q->data->domain, C_IN, q->data->qtype, NULL,
-                      0, NULL, q->send_buf, sizeof(q->send_buf));
-    if (len == -1) {
-        fprintf(stderr, "Failed to create query packet: %s %d\n", q->data->domain,
-                q->data->qtype);
-        return -1;
-    }
+    worker_t  *w;
+    int        i;
 
-    hp = (HEADER *) q->send_buf;
-    hp->rd = 1;    /* recursion */
+    dns_perf_stats_init(total);
 
-    query_id++;
-    q->id = query_id;
+    for (i = 0; i < g_thread_number; i++) {
+        w = &g_worker_array[i];
 
-    /* set message id */
-    net_id = htons(query_id);
-    p = (u_char *) &net_id;
-    q->send_buf[0] = p[0];
-    q->send_buf[1] = p[1];
+        pthread_mutex_lock(&w->report_lock);
+        dns_perf_stats_merge(total, &w->report);
+        pthread_mutex_unlock(&w->report_lock);
+    }
 
-    if (g_real_client) {
-        q->send_buf[11] = 1;   /* set additional count to  1 */
+    dns_perf_stats_sub(total, last);
+}
 
-        p = q->send_buf + len; /* p points to additional section */
 
-        *p++ = 0;      /* root name */
+/*
+ * dns_perf_report_run:
+ *     the reporter thread of -i. At the end of every interval it asks the
+ *     workers for a copy of their statistics, so the send path never
+ *     waits for the report, and prints what changed since the last one.
+ *     When the run ends, what the workers did since then is printed too.
+ */
+static void *dns_perf_report_run(void *arg)
+{
+    static stats_t  total, last;
+    worker_t       *w;
+    uint64_t        start, next, now;
+    unsigned int    seq;
+    int             i, pending;
 
-        *p++ = 0;      /* OPT */
-        *p++ = 41;
+    dns_perf_stats_init(&last);
 
-        *p++ = 4;      /* UDP payload size: 1024 */
-        *p++ = 0;
+    start = dns_perf_now();
 
-        *p++ = 0;      /* extended RCODE and flags */
-        *p++ = 0;
-        *p++ = 0;
-        *p++ = 0;
+    for (seq = 1; /* void */; seq++) {
+        next = start + (uint64_t) seq * g_interval * 1000000;
 
-        *p++ = 0;      /* edns-client-subnet's length */
-        *p++ = 12;
+        while ((now = dns_perf_now()) < next && g_report_quit == 0) {
+            usleep(next - now < 100000 ? next - now : 100000);
+        }
 
-        /* edns-client-subnet */
-        *p++ = 0;      /* option code: 8 */
-        *p++ = 8;
+        if (g_report_quit) {
+            break;
+        }
 
-        *p++ = 0;      /* option length: 8 */
-        *p++ = 8;
+        g_report_seq = seq;
 
-        *p++ = 0;      /* family: 1 */
-        *p++ = 1;
+        /* on quit every worker is finished, this ends at once */
+        do {
+            usleep(1000);
 
-        *p++ = 32;     /* source netmask: 32 */
-        *p++ = 0;      /* scope netmask: 0 */
+            pending = 0;
+            for (i = 0; i < g_thread_number; i++) {
+                w = &g_worker_array[i];
 
-        addr = inet_addr(g_real_client);  /* client subnet */
-        t = (u_char *) &addr;
+                pthread_mutex_lock(&w->report_lock);
+                pending += (w->report_seq != seq && !w->finished);
+                pthread_mutex_unlock(&w->report_lock);
+            }
+        } while (pending != 0);
 
-        *p++ = *t++;
-        *p++ = *t++;
-        *p++ = *t++;
-        *p++ = *t++;
+        dns_perf_report_collect(&total, &last);
+        dns_perf_report_interval(seq * g_interval, g_interval, &total);
 
-        len += 23;
+        dns_perf_stats_merge(&last, &total);
     }
 
-    q->send_len = len;
-    q->send_pos = 0;
+    /*
+     * The workers are done and their final reports hold the rest of the
+     * run, report it as a last, shorter interval.
+     */
+    now = (dns_perf_now() - start + 500) / 1000;
+    dns_perf_report_collect(&total, &last);
+
+    if (total.send_number != 0 || total.recv_number != 0
+        || total.lost_number != 0 || total.skip_number != 0)
+    {
+        dns_perf_report_interval(now / 1000.0,
+                                 now / 1000.0 - (seq - 1) * g_interval,
+                                 &total);
+    }
 
-    return 0;
+    return NULL;
 }
 
 
-int dns_perf_query_process_response(query_t *q, unsigned short id, unsigned short flag)
+/*
+ * dns_perf_json_string:
+ *     print `s' as a JSON string, null for NULL.
+ */
+static void dns_perf_json_string(FILE *f, const char *s)
 {
-    /* 做一些统计工作 */
-    if (q->id != id) {
-        return -1;  /* TODO: can be happened */
+    if (s == NULL) {
+        fputs("null", f);
+        return;
     }
 
-    g_recv_number++;
-
-    switch(flag) {
-    case 0:
-        g_success_number++;
-        break;
-
-    case 1:
-        g_formerr_number++;
-        break;
-
-    case 2:
-        g_serverr_number++;
-        break;
-
-    case 3:
-        g_nxdomain_number++;
-        break;
-
-    case 4:
-        g_notimp_number++;
-        break;
-
-    case 5:
-        g_refuse_number++;
-        break;
+    fputc('"', f);
 
-    default:
-        g_other_number++;
-        break;
+    for ( ; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(f, "\\%c", *s);
+        } else if ((unsigned char) *s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
     }
 
-    return 0;
+    fputc('"', f);
 }
 
 
-int dns_perf_query_send(void *arg)
+/*
+ * dns_perf_json_latency:
+ *     the summary of one latency histogram as a member of an object.
+ */
+static void dns_perf_json_latency(FILE *f, const char *name,
+    dns_perf_histogram_t *h, int last)
 {
-    int ret;
-    query_t *q = arg;
+    fprintf(f, "    \"%s\": { \"count\": %" PRIu64 ", \"mean\": %.3f, "
+            "\"p50\": %" PRIu64 ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64
+            ", \"max\": %" PRIu64 " }%s\n",
+            name, h->count, dns_perf_histogram_mean(h),
+            dns_perf_histogram_percentile(h, 50),
+            dns_perf_histogram_percentile(h, 90),
+            dns_perf_histogram_percentile(h, 99), h->max, last ? "" : ",");
+}
 
 
-    ret = send(q->fd, q->send_buf + q->send_pos, q->send_len - q->send_pos, 0);
-    if (ret < 0) {
-        if (errno != EWOULDBLOCK && errno != EAGAIN) {
-            goto error;
-        }
+/*
+ * dns_perf_json_output:
+ *     write configuration, timestamps, counters and the latency histogram
+ *     of the finished run to g_json_file_name.
+ */
+static int dns_perf_json_output(double elapse)
+{
+    static const char   *selects[] = { NULL, "sequential", "random", "weighted" };
+    static const char   *dists[] = { NULL, "rr", "weighted", "hash" };
+    dns_perf_histogram_t *h = &g_stats.latency;
+    server_t             *server;
+    stats_t              *s;
+    FILE                 *f;
+    char                  addr[INET6_ADDRSTRLEN];
+    uint64_t              low, high;
+    int                   i, first;
+
+    if (strcmp(g_json_file_name, "-") == 0) {
+        f = g_machine_stdout;
+    } else if ((f = fopen(g_json_file_name, "w")) == NULL) {
+        fprintf(stderr, "Open json file %s error: %s\n", g_json_file_name,
+                strerror(errno));
+        return -1;
+    }
 
-        q->state = F_SENDING;
-        if (dns_perf_eventsys_set_fd(q->fd, MOD_WR, q) == -1) {
-            fprintf(stderr, "Error set write fd:%d\n", q->fd);
-            goto error;
-        }
+    fprintf(f, "{\n  \"config\": {\n    \"servers\": [");
 
-    } else { /* already send */
-        if (ret != q->send_len) {
-            q->state = F_SENDING;
-            q->send_pos += ret;
-            if (dns_perf_eventsys_set_fd(q->fd, MOD_WR, q) == -1) {
-                fprintf(stderr, "Error set write fd:%d\n", q->fd);
-                goto error;
-            }
-        }
+    for (i = 0; i < g_server_number; i++) {
+        server = &g_server_array[i];
 
-        q->state = F_READING;
-        if (dns_perf_eventsys_set_fd(q->fd, MOD_RD, q) == -1) {
-            fprintf(stderr, "Error set read fd:%d\n", q->fd);
-            goto error;
-        }
+        fprintf(f, "%s\n      { \"address\": ", i ? "," : "");
+        dns_perf_json_string(f, server->name);
+        fprintf(f, ", \"port\": %u, \"weight\": %u }", server->port,
+                server->weight);
     }
 
-    return 0;
-
- error:
-    close(q->fd);
-    q->state = F_UNUSED;
-
-    return 0;
-}
+    fprintf(f, "\n    ],\n    \"distribution\": \"%s\",\n    \"sources\": [",
+            dists[g_distribute]);
 
-int dns_perf_query_recv(void *arg)
-{
-    //static u_char input[1024];
-    int           ret;
-    unsigned short  id;
-    unsigned short  flags;
-    query_t        *q = arg;
+    for (i = 0; i < g_source_number; i++) {
+        inet_ntop(g_source_array[i].family, g_source_array[i].addr, addr,
+                  sizeof(addr));
+        fprintf(f, "%s\"%s/%u\"", i ? ", " : "", addr,
+                g_source_array[i].prefix);
+    }
 
+    fprintf(f, "],\n    \"source_ports\": ");
+    if (g_source_port_low != 0) {
+        fprintf(f, "[%u, %u]", g_source_port_low, g_source_port_high);
+    } else {
+        fprintf(f, "null");
+    }
 
-    ret = recv(q->fd, q->recv_buf + q->recv_pos, sizeof(q->recv_buf) - q->recv_pos, 0);
+    fprintf(f, ",\n    \"data_file\": ");
+    dns_perf_json_string(f, g_data_file_name);
+    fprintf(f, ",\n    \"protocol\": \"%s\",\n"
+            "    \"family\": \"%s\",\n"
+            "    \"timeout_ms\": %u,\n"
+            "    \"max_queries\": %u,\n"
+            "    \"concurrent_queries\": %u,\n"
+            "    \"run_time_s\": %u,\n"
+            "    \"sockets\": %u,\n"
+            "    \"threads\": %u,\n"
+            "    \"batch\": %u,\n"
+            "    \"rate_qps\": %u,\n"
+            "    \"replay_speed\": %g,\n"
+            "    \"select\": \"%s\",\n"
+            "    \"interval_s\": %u,\n"
+            "    \"event_system\": \"%s\",\n"
+            "    \"tcp_retry\": %s,\n"
+            "    \"edns\": %s,\n"
+            "    \"edns_udp_size\": %u,\n"
+            "    \"edns_do\": %s,\n"
+            "    \"edns_padding\": %u,\n"
+            "    \"client_subnet\": ",
+            g_layer4_protocol == TCP ? "tcp" : "udp",
+            g_server_array[0].addr.ss.ss_family == AF_INET6 ? "inet6" : "inet",
+            g_timeout, g_query_number, g_concurrent_query, g_perf_time,
+            g_sock_number, g_thread_number, g_batch, g_rate, g_replay_speed,
+            selects[g_select], g_interval, dns_perf_eventsys->name,
+            g_tcp_retry ? "true" : "false",
+            (g_edns || g_real_client) ? "true" : "false", g_edns_udp_size,
+            (g_edns_flags & DNS_EDNS_MESSAGEFLAGS_DO) ? "true" : "false",
+            g_edns_padding);
+    dns_perf_json_string(f, g_real_client);
+
+    fprintf(f, "\n  },\n"
+            "  \"start\": %ld.%06ld,\n"
+            "  \"end\": %ld.%06ld,\n"
+            "  \"elapsed_s\": %.6f,\n",
+            (long) g_query_start.tv_sec, (long) g_query_start.tv_usec,
+            (long) g_query_end.tv_sec, (long) g_query_end.tv_usec, elapse);
+
+    fprintf(f, "  \"counters\": {\n"
+            "    \"sent\": %u,\n"
+            "    \"completed\": %u,\n"
+            "    \"lost\": %u,\n"
+            "    \"skipped\": %u,\n"
+            "    \"rcode\": {\n"
+            "      \"noerror\": %u,\n"
+            "      \"formerr\": %u,\n"
+            "      \"servfail\": %u,\n"
+            "      \"nxdomain\": %u,\n"
+            "      \"notimp\": %u,\n"
+            "      \"refused\": %u,\n"
+            "      \"other\": %u\n"
+            "    },\n"
+            "    \"truncated\": %u,\n"
+            "    \"empty\": %u,\n"
+            "    \"mismatched\": %u,\n"
+            "    \"malformed\": %u,\n"
+            "    \"tcp_retries\": %u,\n"
+            "    \"tcp_answered\": %u\n"
+            "  },\n"
+            "  \"qps\": %.3f,\n",
+            g_stats.send_number, g_stats.recv_number, g_stats.lost_number,
+            g_stats.skip_number, g_stats.success_number, g_stats.formerr_number,
+            g_stats.serverr_number, g_stats.nxdomain_number,
+            g_stats.notimp_number, g_stats.refuse_number, g_stats.other_number,
+            g_stats.truncated_number, g_stats.empty_number,
+            g_stats.mismatch_number, g_stats.malformed_number,
+            g_stats.retry_number, g_stats.retry_recv_number,
+            elapse > 0 ? g_stats.send_number / elapse : 0.0);
+
+    if (g_tcp_retry) {
+        fprintf(f, "  \"tcp_retry_us\": {\n");
+        dns_perf_json_latency(f, "udp", &g_stats.udp_latency, 0);
+        dns_perf_json_latency(f, "tcp", &g_stats.tcp_latency, 0);
+        dns_perf_json_latency(f, "total", &g_stats.retry_latency, 1);
+        fprintf(f, "  },\n");
+    }
 
-    if (ret < 0) {
-        if (errno != EWOULDBLOCK && errno != EAGAIN) {
-            close(q->fd);
-            q->state = F_UNUSED;
-            return 0;
-        }
+    fprintf(f, "  \"servers\": [");
+
+    for (i = 0; i < g_server_number; i++) {
+        server = &g_server_array[i];
+        s = &g_server_stats[i];
+
+        fprintf(f, "%s\n  {\n    \"address\": ", i ? "," : "");
+        dns_perf_json_string(f, server->name);
+        fprintf(f, ",\n    \"port\": %u,\n"
+                "    \"sent\": %u,\n"
+                "    \"completed\": %u,\n"
+                "    \"lost\": %u,\n"
+                "    \"qps\": %.3f,\n"
+                "    \"rcode\": { \"noerror\": %u, \"formerr\": %u, "
+                "\"servfail\": %u, \"nxdomain\": %u, \"notimp\": %u, "
+                "\"refused\": %u, \"other\": %u },\n"
+                "    \"truncated\": %u,\n"
+                "    \"mismatched\": %u,\n"
+                "    \"malformed\": %u,\n",
+                server->port, s->send_number, s->recv_number, s->lost_number,
+                elapse > 0 ? s->send_number / elapse : 0.0,
+                s->success_number, s->formerr_number, s->serverr_number,
+                s->nxdomain_number, s->notimp_number, s->refuse_number,
+                s->other_number, s->truncated_number, s->mismatch_number,
+                s->malformed_number);
+        dns_perf_json_latency(f, "latency_us", &s->latency, 1);
+        fprintf(f, "  }");
+    }
 
-        if (dns_perf_eventsys_set_fd(q->fd, MOD_RD, q) == -1) {
-            close(q->fd);
-            q->state = F_UNUSED;
-            return 0;
+    fprintf(f, "\n  ],\n");
+
+    fprintf(f, "  \"latency_us\": {\n"
+            "    \"count\": %" PRIu64 ",\n"
+            "    \"min\": %" PRIu64 ",\n"
+            "    \"mean\": %.3f,\n"
+            "    \"p50\": %" PRIu64 ",\n"
+            "    \"p90\": %" PRIu64 ",\n"
+            "    \"p99\": %" PRIu64 ",\n"
+            "    \"p99_9\": %" PRIu64 ",\n"
+            "    \"max\": %" PRIu64 ",\n"
+            "    \"buckets\": [",
+            h->count, h->count ? h->min : 0, dns_perf_histogram_mean(h),
+            dns_perf_histogram_percentile(h, 50),
+            dns_perf_histogram_percentile(h, 90),
+            dns_perf_histogram_percentile(h, 99),
+            dns_perf_histogram_percentile(h, 99.9), h->max);
+
+    /* [low, high, count] of every bucket in use */
+    for (i = 0, first = 1; i < HISTOGRAM_BUCKETS; i++) {
+        if (h->buckets[i] == 0) {
+            continue;
         }
-    } else {
-        close(q->fd);
-        q->state = F_UNUSED;
 
-        //id = input[0] * 256 + input[1];
-        //flags = input[2] * 256 + input[3];
+        dns_perf_histogram_bucket_range(i, &low, &high);
+        fprintf(f, "%s\n      [%" PRIu64 ", %" PRIu64 ", %" PRIu64 "]",
+                first ? "" : ",", low, high, h->buckets[i]);
+        first = 0;
+    }
 
-        id = q->recv_buf[0] << 8 | q->recv_buf[1];
-        flags = q->recv_buf[2] << 8 | q->recv_buf[3];
+    fprintf(f, "%s]\n  }\n}\n", first ? "" : "\n    ");
 
-        dns_perf_query_process_response(q, id, flags & 0xF);
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Write json file %s error: %s\n", g_json_file_name,
+                strerror(errno));
+        return -1;
     }
 
     return 0;
 }
 
 
-static int dns_perf_cancel_timeout_query()
+static void dns_perf_latency_statistic(dns_perf_histogram_t *h)
 {
-    int       i;
-    query_t  *query;
-    timeval_t now, diff;
-
-    /* Deal with timeout */
-    gettimeofday(&now, NULL);
-    for (i = 0; i < g_concurrent_query ; i++) {
-
-        query = &g_query_array[i];
+    printf("\n[Result]Latency min(ms):\t%.3f\n", h->min / 1000.0);
+    printf("[Result]Latency mean(ms):\t%.3f\n", dns_perf_histogram_mean(h) / 1000.0);
+    printf("[Result]Latency p50(ms):\t%.3f\n",
+           dns_perf_histogram_percentile(h, 50) / 1000.0);
+    printf("[Result]Latency p90(ms):\t%.3f\n",
+           dns_perf_histogram_percentile(h, 90) / 1000.0);
+    printf("[Result]Latency p99(ms):\t%.3f\n",
+           dns_perf_histogram_percentile(h, 99) / 1000.0);
+    printf("[Result]Latency p99.9(ms):\t%.3f\n",
+           dns_perf_histogram_percentile(h, 99.9) / 1000.0);
+    printf("[Result]Latency max(ms):\t%.3f\n", h->max / 1000.0);
+}
 
-        if (query->state == F_UNUSED) {
-            continue;
-        }
 
-        diff = dns_perf_timer_sub(now, query->sands);
-        if (diff.tv_sec * 1000000 + diff.tv_usec >= 0) {
-            /* delete timeouted queries */
-            if (query->state == F_SENDING) {
-                dns_perf_eventsys_clear_fd(query->fd, MOD_WR);
-            } else if (query->state == F_READING) {
-                dns_perf_eventsys_clear_fd(query->fd, MOD_RD);
-            }
+/*
+ * dns_perf_retry_statistic:
+ *     -R: how the queries asked again over TCP did, the latency of the
+ *     UDP leg, of the TCP leg and of both.
+ */
+static void dns_perf_retry_statistic(stats_t *s)
+{
+    printf("[Result]TCP retries:\t\t%u\n", s->retry_number);
+    printf("[Result]TCP retries answered:\t%u\n", s->retry_recv_number);
 
-            close(query->fd);
-            query->state = F_UNUSED;
-        }
+    if (s->retry_latency.count == 0) {
+        printf("\n");
+        return;
     }
 
-    return 0;
+    printf("[Result]Retry latency p50/p99(ms):\tudp %.3f/%.3f tcp %.3f/%.3f"
+           " total %.3f/%.3f\n\n",
+           dns_perf_histogram_percentile(&s->udp_latency, 50) / 1000.0,
+           dns_perf_histogram_percentile(&s->udp_latency, 99) / 1000.0,
+           dns_perf_histogram_percentile(&s->tcp_latency, 50) / 1000.0,
+           dns_perf_histogram_percentile(&s->tcp_latency, 99) / 1000.0,
+           dns_perf_histogram_percentile(&s->retry_latency, 50) / 1000.0,
+           dns_perf_histogram_percentile(&s->retry_latency, 99) / 1000.0);
 }
 
 
-
-
 /*
- * dns_perf_prepare:
- *     Do some preparation before quering.
- *   1. allocate query_array
+ * dns_perf_server_statistic:
+ *     the breakdown of the run by server, when there are several of them.
  */
-static int dns_perf_prepare()
+static void dns_perf_server_statistic(double elapse)
 {
-    query_t    *q;
-    int         i, index;
+    server_t              *server;
+    stats_t               *s;
+    dns_perf_histogram_t  *h;
+    int                    i;
+
+    printf("\n");
+
+    for (i = 0; i < g_server_number; i++) {
+        server = &g_server_array[i];
+        s = &g_server_stats[i];
+        h = &s->latency;
+
+        printf("[Result]Server %s#%u:\tsent %u completed %u qps %.1f"
+               " loss %.2f%% p50 %.3f p90 %.3f p99 %.3f ms\n",
+               server->name, server->port, s->send_number, s->recv_number,
+               elapse > 0 ? s->send_number / elapse : 0.0,
+               s->lost_number
+                   ? s->lost_number * 100.0 / (s->recv_number + s->lost_number)
+                   : 0.0,
+               dns_perf_histogram_percentile(h, 50) / 1000.0,
+               dns_perf_histogram_percentile(h, 90) / 1000.0,
+               dns_perf_histogram_percentile(h, 99) / 1000.0);
+
+        printf("[Result]    noerror %u formerr %u servfail %u nxdomain %u"
+               " notimp %u refused %u other %u truncated %u\n",
+               s->success_number, s->formerr_number, s->serverr_number,
+               s->nxdomain_number, s->notimp_number, s->refuse_number,
+               s->other_number, s->truncated_number);
+    }
+}
 
-    g_query_array = calloc(g_concurrent_query, sizeof(query_t));
-    if (g_query_array == NULL) {
+
+static int dns_perf_statistic()
+{
+    timeval_t     diff;
+    unsigned int  msec, dropped;
+    double        elapse, qps;
+    int           i, j;
+
+
+    dns_perf_stats_init(&g_stats);
+
+    for (i = 0; i < g_thread_number; i++) {
+        dns_perf_stats_merge(&g_stats, &g_worker_array[i].stats);
+    }
+
+    g_server_stats = calloc(g_server_number, sizeof(stats_t));
+    if (g_server_stats == NULL) {
         fprintf(stderr, "Error memory low");
         return -1;
     }
 
-    for (i = 0; i < g_concurrent_query; i++) {
+    for (j = 0; j < g_server_number; j++) {
+        dns_perf_stats_init(&g_server_stats[j]);
 
-        index = random() % g_data_array_len;
+        for (i = 0; i < g_thread_number; i++) {
+            dns_perf_stats_merge(&g_server_stats[j],
+                                 &g_worker_array[i].server_stats[j]);
+        }
+    }
 
-        q = &g_query_array[i];
+    diff = dns_perf_timer_sub(g_query_end, g_query_start);
+    msec = diff.tv_sec * 1000 + diff.tv_usec / 1000;
 
-        q->data = &g_data_array[index];
-        q->ops.send = dns_perf_query_send;
-        q->ops.recv = dns_perf_query_recv;
-        q->id = q->fd = -1;
-        q->send_pos = q->recv_pos = 0;
-        q->state = F_UNUSED;
+    printf("\n[Status]DNS Query Performance Testing Finish\n");
+    printf("[Result]Quries sent:\t\t%d\n", g_stats.send_number);
+    printf("[Result]Quries completed:\t%d\n", g_stats.recv_number);
+    printf("[Result]Complete percentage:\t%.2f\n\n",
+           g_stats.recv_number * 100.0 / g_stats.send_number);
+
+    printf("[Result]Truncated responses:\t%u\n", g_stats.truncated_number);
+    printf("[Result]Empty answers:\t\t%u\n", g_stats.empty_number);
+    printf("[Result]Mismatched responses:\t%u\n", g_stats.mismatch_number);
+    printf("[Result]Malformed responses:\t%u\n\n", g_stats.malformed_number);
+
+    if (g_tcp_retry) {
+        dns_perf_retry_statistic(&g_stats);
     }
 
-    return 0;
-}
-
+    if (g_report_rcode) {
+        printf("[Result]Rcode=Success:\t%d\n\n", g_stats.success_number);
+        printf("[Result]Rcode=FormatError:\t%d\n\n", g_stats.formerr_number);
+        printf("[Result]Rcode=ServerError:\t%d\n\n", g_stats.serverr_number);
+        printf("[Result]Rcode=NXDOMAIN:\t%d\n\n", g_stats.nxdomain_number);
+        printf("[Result]Rcode=NotImp:\t%d\n\n", g_stats.notimp_number);
+        printf("[Result]Rcode=Refuse:\t%d\n\n", g_stats.refuse_number);
+        printf("[Result]Rcode=Others:\t%d\n\n", g_stats.other_number);
+    }
 
-/*
- * Whip query_t to make it as busy as possible.
- */
-static int dns_perf_whip_query()
-{
-    int       i;
-    query_t  *q;
-    timeval_t tv;
+    if (g_rate != 0) {
+        printf("[Result]Target rate(qps):\t%d\n", g_rate);
+    }
 
-    for (i = 0; i < g_concurrent_query; i++) {
+    if (g_replay_speed != 0) {
+        printf("[Result]Replay speed:\t\t%gx\n", g_replay_speed);
+    }
 
-        q = &g_query_array[i];
+    if (g_rate != 0 || g_replay_speed != 0) {
+        printf("[Result]Queries skipped:\t%d\n\n", g_stats.skip_number);
+    }
 
-        if (q->state != F_UNUSED) {
-            continue;
+    if (g_capture_file_name != NULL) {
+        for (dropped = 0, i = 0; i < g_thread_number; i++) {
+            dropped += g_worker_array[i].capture_dropped;
         }
 
-        q->fd = dns_perf_open_udp_socket(g_name_server, g_name_server_port,
-                                         g_net_family);
-        if (q->fd == -1) {
-            fprintf(stderr, "Error create udp socket failed\n");
-            return -1;
-        }
+        printf("[Result]Packets captured:\t%u\n", g_capture_written);
+        printf("[Result]Packets dropped:\t%u\n\n", dropped);
+    }
 
-        q->state = F_CONNECTING;
+    elapse = msec * 1.0 / 1000;
+    printf("[Result]Elapsed time(s):\t%.5f\n\n", elapse);
 
-        if (dns_perf_generate_query(q) != 0) {
-            return -1;
-        }
 
-        gettimeofday(&tv, NULL);
-        q->sands = dns_perf_timer_add_long(tv, g_timeout * 1000);
+    qps = g_stats.send_number / elapse;
+    printf("[Result]Queries Per Second:\t%.5f\n", qps);
 
-        /* send query to remote name server */
-        if (dns_perf_query_send(q) == -1) {
-            continue;
-        }
+    if (g_stats.latency.count > 0) {
+        dns_perf_latency_statistic(&g_stats.latency);
+    }
 
-        g_send_number++;
+    if (g_server_number > 1) {
+        dns_perf_server_statistic(elapse);
+    }
+
+    if (g_json_file_name != NULL) {
+        return dns_perf_json_output(elapse);
     }
 
     return 0;
 }
 
 
-static int dns_perf_clear_query()
+/*
+ * dns_perf_raise_nofile:
+ *     make room for the sockets of the run, one per query without -S,
+ *     twice as many with the TCP connections of -R.
+ *     Short of it, opening sockets fails and queries are skipped.
+ */
+static void dns_perf_raise_nofile(void)
 {
-    int i;
-    query_t  *q;
-
-    for (i = 0; i < g_concurrent_query; i++) {
+    struct rlimit  limit;
+    rlim_t         need, fixed, per;
+
+    /* -R: a TCP connection besides every UDP socket */
+    per = g_tcp_retry ? 2 : 1;
+    fixed = 2 * g_thread_number + 64;
+    need = (g_sock_number == 0 ? g_concurrent_query
+                               : g_sock_number * g_server_number) * per
+           + fixed;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur >= need) {
+        return;
+    }
 
-        q = &g_query_array[i];
+    if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < need) {
+        limit.rlim_max = need;
+    }
 
-        if (q->state != F_UNUSED) {
-            close(q->fd);
-        }
+    limit.rlim_cur = need;
 
-        q->state = F_UNUSED;
+    if (setrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        return;
     }
 
-    return 0;
+    /* not allowed to raise the hard limit, take what it gives */
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    fprintf(stderr, "Warning: open files limited to %lu, %lu are needed\n",
+            (unsigned long) limit.rlim_cur, (unsigned long) need);
+
+    /* a socket per query, run fewer of them than fail to open them */
+    if (g_sock_number == 0
+        && limit.rlim_cur > fixed + g_thread_number * per)
+    {
+        g_concurrent_query = (limit.rlim_cur - fixed) / per;
+        fprintf(stderr, "Warning: concurrent queries cut to %u\n",
+                g_concurrent_query);
+    }
 }
 
 
-static void dns_perf_statistic()
+/*
+ * dns_perf_machine_stdout:
+ *     with -o - or -O - stdout carries nothing but JSON or CSV, what is
+ *     printed for humans goes to stderr instead.
+ */
+static int dns_perf_machine_stdout()
 {
-    timeval_t     diff;
-    unsigned int  msec;
-    double        elapse, qps;
+    int  json, csv, fd;
 
+    json = (g_json_file_name != NULL && strcmp(g_json_file_name, "-") == 0);
+    csv = (g_csv_file_name != NULL && strcmp(g_csv_file_name, "-") == 0);
 
-    diff = dns_perf_timer_sub(g_query_end, g_query_start);
-    msec = diff.tv_sec * 1000 + diff.tv_usec / 1000;
-
-    printf("\n[Status]DNS Query Performance Testing Finish\n");
-    printf("[Result]Quries sent:\t\t%d\n", g_send_number);
-    printf("[Result]Quries completed:\t%d\n", g_recv_number);
-    printf("[Result]Complete percentage:\t%.2f\n\n", g_recv_number * 100.0 / g_send_number);
+    if (json && csv) {
+        fprintf(stderr, "-o - and -O - can't both write to stdout\n");
+        return -1;
+    }
 
-    if (g_report_rcode) {
-        printf("[Result]Rcode=Success:\t%d\n\n", g_success_number);
-        printf("[Result]Rcode=FormatError:\t%d\n\n", g_formerr_number);
-        printf("[Result]Rcode=ServerError:\t%d\n\n", g_serverr_number);
-        printf("[Result]Rcode=NXDOMAIN:\t%d\n\n", g_nxdomain_number);
-        printf("[Result]Rcode=NotImp:\t%d\n\n", g_notimp_number);
-        printf("[Result]Rcode=Refuse:\t%d\n\n", g_refuse_number);
-        printf("[Result]Rcode=Others:\t%d\n\n", g_other_number);
+    if (!json && !csv) {
+        return 0;
     }
 
-    elapse = msec * 1.0 / 1000;
-    printf("[Result]Elapsed time(s):\t%.5f\n\n", elapse);
+    fflush(stdout);
 
+    if ((fd = dup(STDOUT_FILENO)) == -1
+        || (g_machine_stdout = fdopen(fd, "w")) == NULL
+        || dup2(STDERR_FILENO, STDOUT_FILENO) == -1)
+    {
+        fprintf(stderr, "Error redirecting stdout: %s\n", strerror(errno));
+        return -1;
+    }
 
-    qps = g_send_number / elapse;
-    printf("[Result]Queries Per Second:\t%.5f\n", qps);
+    return 0;
 }
 
 
@@ -880,11 +4714,8 @@ static void dns_perf_statistic()
  */
 int dns_perf_setup(int argc, char **argv)
 {
-
-    if (dns_perf_set_str(&g_name_server, DEFAULT_SERVER) == -1) {
-        fprintf(stderr, "%s: Unable to set default name_server\n", argv[0]);
-        return -1;
-    }
+    int        i;
+    server_t  *server;
 
     if (dns_perf_set_uint(&g_name_server_port, DEFAULT_PORT) == -1) {
         fprintf(stderr, "%s: Unable to set default name_server's port\n", argv[0]);
@@ -906,15 +4737,95 @@ int dns_perf_setup(int argc, char **argv)
         return -1;
     }
 
+    if (dns_perf_set_uint(&g_thread_number, DEFAULT_THREAD_NUM) == -1) {
+        fprintf(stderr, "%s: Unable to set default thread number\n", argv[0]);
+        return -1;
+    }
+
+    if (dns_perf_set_uint(&g_batch, DEFAULT_BATCH) == -1) {
+        fprintf(stderr, "%s: Unable to set default batch size\n", argv[0]);
+        return -1;
+    }
+
     if (dns_perf_parse_args(argc, argv) == -1) {
         dns_perf_show_usage();
         return -1;
     }
 
+    if (dns_perf_machine_stdout() == -1) {
+        return -1;
+    }
+
+    dns_perf_show_info();
+
+    if (g_server_number == 0 && dns_perf_add_server(DEFAULT_SERVER) == -1) {
+        fprintf(stderr, "%s: Unable to set default name_server\n", argv[0]);
+        return -1;
+    }
+
+    for (i = 0; i < g_server_number; i++) {
+        server = &g_server_array[i];
+
+        if (server->port == 0) {
+            server->port = g_name_server_port;
+        }
+
+        if (dns_perf_resolve_addr(server->name, server->port, g_net_family,
+                                  &server->addr) == -1)
+        {
+            return -1;
+        }
+
+        g_server_weight_total += server->weight;
+        server->weight_end = g_server_weight_total;
+
+        if (g_source_number != 0
+            && g_source_total[server->addr.ss.ss_family == AF_INET6] == 0)
+        {
+            fprintf(stderr, "%s: no source address of -a in the family of "
+                    "server %s\n", argv[0], server->name);
+            return -1;
+        }
+    }
+
     if (dns_perf_data_array_init() == -1) {
         return -1;
     }
 
+    if (g_csv_file_name != NULL) {
+        if (strcmp(g_csv_file_name, "-") == 0) {
+            g_csv_file = g_machine_stdout;
+        } else if ((g_csv_file = fopen(g_csv_file_name, "w")) == NULL) {
+            fprintf(stderr, "Open csv file %s error: %s\n", g_csv_file_name,
+                    strerror(errno));
+            return -1;
+        }
+
+        fprintf(g_csv_file, "time,elapsed_s,sent,completed,qps,lost,skipped,"
+                "p50_us,p90_us,p99_us,p99_9_us,max_us,noerror,formerr,servfail,"
+                "nxdomain,notimp,refused,other,truncated,empty,mismatch,"
+                "malformed,tcp_retries,tcp_answered\n");
+    }
+
+    if (g_capture_file_name != NULL) {
+        if ((g_capture_file = fopen(g_capture_file_name, "w")) == NULL) {
+            fprintf(stderr, "Open capture file %s error: %s\n",
+                    g_capture_file_name, strerror(errno));
+            return -1;
+        }
+
+        setvbuf(g_capture_file, NULL, _IOFBF, 1 << 20);
+
+        if (dns_perf_pcap_write_header(g_capture_file, CAPTURE_SNAPLEN + 48)
+            == -1)
+        {
+            fprintf(stderr, "Write capture file %s error\n", g_capture_file_name);
+            return -1;
+        }
+    }
+
+    dns_perf_raise_nofile();
+    g_concurrent_limit = g_concurrent_query;
 
     return 0;
 }
@@ -922,75 +4833,147 @@ int dns_perf_setup(int argc, char **argv)
 
 int main(int argc, char** argv)
 {
-    timeval_t  now, age;
+    int        i, ret;
+    worker_t  *w;
+    server_t  *server;
+    pthread_t  reporter, capturer;
 
 
-    dns_perf_show_info();
     signal(SIGINT, sig_handler);
     signal(SIGTERM, sig_handler);
+    signal(SIGHUP, sig_handler);
+
+    /* the -X cookie client cookie and the first DNS ids come from random() */
+    srandom(dns_perf_now() ^ ((uint64_t) getpid() << 20));
 
     if (dns_perf_setup(argc, argv) == -1) {
         return -1;
     }
 
     printf("[Status] Processing query data\n");
-    if (dns_perf_prepare() == -1) {
+
+    if ((g_worker_array = calloc(g_thread_number, sizeof(worker_t))) == NULL) {
+        fprintf(stderr, "Error memory low");
         return -1;
     }
 
-    if (dns_perf_set_event_sys() == -1) {
-        return -1;
+    for (i = 0; i < g_thread_number; i++) {
+        w = &g_worker_array[i];
+        w->index = i;
+
+        if (dns_perf_prepare(w) == -1) {
+            return -1;
+        }
     }
 
-    if (dns_perf_eventsys_init() == -1) {
+    if (dns_perf_set_event_sys(g_event_sys_name) == -1) {
         return -1;
     }
 
-    printf("[Status] Sending queries to %s:%d\n", g_name_server, g_name_server_port);
-    gettimeofday(&g_query_start, NULL);
+    for (i = 0; i < g_server_number; i++) {
+        server = &g_server_array[i];
 
-    /* how long can you live */
-    age = dns_perf_timer_add_long(g_query_start, g_perf_time * 1000000);
+        printf(server->addr.ss.ss_family == AF_INET6
+               ? "[Status] Sending queries to [%s]:%d\n"
+               : "[Status] Sending queries to %s:%d\n",
+               server->name, server->port);
+    }
+    gettimeofday(&g_query_start, NULL);
 
-    if (dns_perf_whip_query() == -1) {
+    if (g_capture_file != NULL
+        && pthread_create(&capturer, NULL, dns_perf_capture_run, NULL) != 0)
+    {
+        fprintf(stderr, "Error create capture thread\n");
         return -1;
     }
 
-    while (g_stop == 0) {
-        dns_perf_eventsys_dispatch(g_timeout);
-
-        dns_perf_cancel_timeout_query();
+    if (g_interval != 0
+        && pthread_create(&reporter, NULL, dns_perf_report_run, NULL) != 0)
+    {
+        fprintf(stderr, "Error create reporter thread\n");
+        g_interval = 0;
+    }
 
-        /* Is time up? */
-        if (g_perf_time != 0) {
-            gettimeofday(&now, NULL);
-            if (dns_perf_timer_cmp(now, age) > 0) {
-                printf("time up");
-                break;
-            }
-        }
+    /* worker 0 runs in the main thread */
+    for (i = 1; i < g_thread_number; i++) {
+        w = &g_worker_array[i];
 
-        /* Is query number overflowed? */
-        if (g_send_number >= g_query_number) {
+        if (pthread_create(&w->tid, NULL, dns_perf_worker_run, w) != 0) {
+            fprintf(stderr, "Error create worker thread %d\n", i);
+            g_stop = 1;
+            g_thread_number = i;
             break;
         }
+    }
+
+    dns_perf_worker_run(&g_worker_array[0]);
 
-        dns_perf_whip_query();
+    for (i = 1; i < g_thread_number; i++) {
+        pthread_join(g_worker_array[i].tid, NULL);
     }
 
     gettimeofday(&g_query_end, NULL);
 
-    dns_perf_statistic();
+    if (g_interval != 0) {
+        g_report_quit = 1;
+        pthread_join(reporter, NULL);
+    }
+
+    ret = 0;
+    for (i = 0; i < g_thread_number; i++) {
+        if (g_worker_array[i].ret == -1) {
+            ret = -1;
+        }
+    }
+
+    if (g_capture_file != NULL) {
+        g_capture_quit = 1;
+        pthread_join(capturer, NULL);
+
+        if (fclose(g_capture_file) != 0 || g_capture_failed) {
+            fprintf(stderr, "Write capture file %s error\n", g_capture_file_name);
+            ret = -1;
+        }
+    }
+
+    if (dns_perf_statistic() == -1) {
+        ret = -1;
+    }
+
+    if (g_csv_file != NULL) {
+        fclose(g_csv_file);
+    }
 
-    dns_perf_clear_query();
+    for (i = 0; i < g_thread_number; i++) {
+        free(g_worker_array[i].query_array);
+        free(g_worker_array[i].sock_array);
+        free(g_worker_array[i].retry_array);
+        free(g_worker_array[i].server_stats);
+        free(g_worker_array[i].ecs_array);
+        free(g_worker_array[i].capture_ring);
+        pthread_mutex_destroy(&g_worker_array[i].report_lock);
+    }
 
+    free(g_worker_array);
     free(g_data_array);
-    free(g_query_array);
-    free(g_name_server);
-    free(g_data_file_name);
+    free(g_name_arena);
+    free(g_weight_array);
+    free(g_replay_time);
+    free(g_template_arena);
+    for (i = 0; i < g_server_number; i++) {
+        free(g_server_array[i].name);
+    }
 
-    dns_perf_eventsys_destroy();
+    free(g_server_array);
+    free(g_source_array);
+    free(g_ecs_array);
+    free(g_real_client);
+    free(g_server_stats);
+    free(g_event_sys_name);
+    free(g_json_file_name);
+    free(g_csv_file_name);
+    free(g_capture_file_name);
+    free(g_data_file_name);
 
-    return 0;
+    return ret;
 }
-
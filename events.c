@@ -27,9 +27,47 @@
 #include <sys/event.h>
 #endif
 
+#ifdef HAVE_IO_URING
+#include <stdint.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
 
 dns_perf_eventsys_t *dns_perf_eventsys = NULL;
 
+/*
+ * dns_perf_events_grow:
+ *     resize a per-fd table from `size' to `new_size' entries of `elt'
+ *     bytes, the new entries are zeroed.
+ */
+static int dns_perf_events_grow(void **tab, int size, int new_size, size_t elt)
+{
+    char *p;
+
+    if ((p = realloc(*tab, (size_t) new_size * elt)) == NULL) {
+        fprintf(stderr, "Error: grow fd table to %d failure.\n", new_size);
+        return -1;
+    }
+
+    memset(p + (size_t) size * elt, 0, (size_t) (new_size - size) * elt);
+    *tab = p;
+
+    return 0;
+}
+
+static int dns_perf_events_size(int size, int fd)
+{
+    while (size <= fd) {
+        size *= 2;
+    }
+
+    return size;
+}
+
 #ifdef HAVE_EPOLL
 
 typedef struct dns_perf_epoll_data_s {
@@ -37,42 +75,35 @@ typedef struct dns_perf_epoll_data_s {
     struct fddata      *fdtab;      /* fd data in epoll */
     struct epoll_event *events;
     int                 fd_size;
+    int                *pending;    /* epoll-et: fds ready without an edge */
+    int                 npending;
 } dns_perf_epoll_data_t;
 
-static dns_perf_epoll_data_t *ep = NULL;
+/* every worker thread has its own epoll instance */
+static __thread dns_perf_epoll_data_t *ep = NULL;
 
 static int dns_perf_epoll_init(void)
 {
-    struct rlimit       limit;
-
     if ((ep = (dns_perf_epoll_data_t *)malloc(sizeof(dns_perf_epoll_data_t))) == NULL) {
         return -1;
     }
 
     /* create epoll */
-    if ((ep->fd = epoll_create(MAX_EVENT_SOCKS)) < 0) {
+    if ((ep->fd = epoll_create(EVENT_FD_SIZE)) < 0) {
         fprintf(stderr, "Error call epoll_create");
         goto fail_fd;
     }
 
-    /* set fd ulimits */
-    limit.rlim_cur = limit.rlim_max = MAX_EVENT_SOCKS;
-    if (setrlimit(RLIMIT_NOFILE, &limit) == -1){
-        fprintf(stderr, "Error: set ulimits fd to %d failure. reason:%s\n",
-                MAX_EVENT_SOCKS, strerror(errno));
-        goto fail_limit;
-    }
-
     /* allocate epoll events */
-    ep->fd_size = MAX_EVENT_SOCKS;
-    if ((ep->events = (struct epoll_event *) calloc(ep->fd_size,
+    if ((ep->events = (struct epoll_event *) calloc(MAX_EVENTS,
                                                     sizeof(struct epoll_event))) == NULL)
     {
         fprintf(stderr, "Error: alloc epoll event failure.");
-        goto fail_limit;
+        goto fail_events;
     }
 
-    /* create fdtable */
+    /* create fdtable, set_fd grows it */
+    ep->fd_size = EVENT_FD_SIZE;
     if ((ep->fdtab = (struct fddata *) calloc(ep->fd_size,
                                               sizeof(struct fddata))) == NULL)
     {
@@ -80,11 +111,19 @@ static int dns_perf_epoll_init(void)
         goto fail_fdtab;
     }
 
+    ep->npending = 0;
+    if ((ep->pending = (int *) calloc(ep->fd_size, sizeof(int))) == NULL) {
+        fprintf(stderr, "Error: alloc fddata failure.");
+        goto fail_pending;
+    }
+
     return 0;
 
+fail_pending:
+    free(ep->fdtab);
 fail_fdtab:
     free(ep->events);
-fail_limit:
+fail_events:
     close(ep->fd);
 fail_fd:
     free(ep);
@@ -93,9 +132,34 @@ fail_fd:
 }
 
 
+static int dns_perf_epoll_expand(int fd)
+{
+    int size;
+
+    if (fd < ep->fd_size) {
+        return 0;
+    }
+
+    size = dns_perf_events_size(ep->fd_size, fd);
+
+    if (dns_perf_events_grow((void **) &ep->fdtab, ep->fd_size, size,
+                             sizeof(struct fddata)) == -1
+        || dns_perf_events_grow((void **) &ep->pending, ep->fd_size, size,
+                                sizeof(int)) == -1)
+    {
+        return -1;
+    }
+
+    ep->fd_size = size;
+
+    return 0;
+}
+
+
 static int dns_perf_epoll_destroy(void)
 {
     if (ep) {
+        free(ep->pending);
         free(ep->fdtab);
         free(ep->events);
 
@@ -118,11 +182,16 @@ static int dns_perf_epoll_clear_fd(int fd, int mod)
     struct epoll_event ev;
 
 
+    if (fd >= ep->fd_size) {
+        return 0;
+    }
+
     if (mod == MOD_RD) {
         ep->fdtab[fd].events &= ~EPOLLIN;
     } else if (mod == MOD_WR) {
         ep->fdtab[fd].events &= ~EPOLLOUT;
     }
+    ev.data.fd = fd;
     ev.events = ep->fdtab[fd].events;
 
     if (ep->fdtab[fd].events == 0) {
@@ -143,6 +212,10 @@ static int dns_perf_epoll_clear_fd(int fd, int mod)
 
 static void *dns_perf_epoll_get_obj_by_fd(int fd, int mod)
 {
+    if (fd >= ep->fd_size) {
+        return NULL;
+    }
+
     return ep->fdtab[fd].cb[mod].arg;
 }
 
@@ -153,23 +226,35 @@ static int dns_perf_epoll_do_wait(long timeout)
     int nevents;
     dns_perf_event_ops_t *op;
 
-    nevents = epoll_wait(ep->fd, ep->events, ep->fd_size, timeout);
+    nevents = epoll_wait(ep->fd, ep->events, MAX_EVENTS, timeout);
 
     if (nevents < 0) {
-        fprintf(stderr, "epoll_wait error:%s", strerror(errno));
+        if (errno == EINTR) {
+            return 0;
+        }
+
+        fprintf(stderr, "epoll_wait error:%s\n", strerror(errno));
         return -1;
     }
 
     for (i = 0; i < nevents; i++) {
         fd = ep->events[i].data.fd;
 
-        if (ep->events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+        /*
+         * A callback may close the fd, so look at fdtab again before
+         * dispatching the other direction.
+         */
+        if ((ep->events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            && (ep->fdtab[fd].events & EPOLLOUT))
+        {
             op = (dns_perf_event_ops_t *) ep->fdtab[fd].cb[MOD_WR].arg;
             dns_perf_epoll_clear_fd(fd, MOD_WR);
             op->send((void *) op);
         }
 
-        if (ep->events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        if ((ep->events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            && (ep->fdtab[fd].events & EPOLLIN))
+        {
             op = (dns_perf_event_ops_t *) ep->fdtab[fd].cb[MOD_RD].arg;
             dns_perf_epoll_clear_fd(fd, MOD_RD);
             op->recv((void *) op);
@@ -181,12 +266,27 @@ static int dns_perf_epoll_do_wait(long timeout)
 
 static int dns_perf_epoll_set_fd(int fd, int mod, void *arg)
 {
-    int                opcode;
+    int                opcode, events;
     struct epoll_event ev;
 
 
-    if (fd > ep->fd_size) {
-        // TODO: expand
+    if (dns_perf_epoll_expand(fd) == -1) {
+        return -1;
+    }
+
+    if (mod == MOD_RD) {
+        events = EPOLLIN;
+    } else if(mod == MOD_WR) {
+        events = EPOLLOUT;
+    } else {
+        return -1;
+    }
+
+    ep->fdtab[fd].cb[mod].arg = arg;
+
+    /* reading and writing may be watched at the same time */
+    if (ep->fdtab[fd].events & events) {
+        return 0;
     }
 
     if (ep->fdtab[fd].events == 0) {
@@ -195,13 +295,7 @@ static int dns_perf_epoll_set_fd(int fd, int mod, void *arg)
         opcode = EPOLL_CTL_MOD;
     }
 
-    if (mod == MOD_RD) {
-        ep->fdtab[fd].events = EPOLLIN;
-    } else if(mod == MOD_WR) {
-        ep->fdtab[fd].events = EPOLLOUT;
-    } else {
-        return -1;
-    }
+    ep->fdtab[fd].events |= events;
 
     ev.data.fd = fd;
     ev.events = ep->fdtab[fd].events;
@@ -209,16 +303,19 @@ static int dns_perf_epoll_set_fd(int fd, int mod, void *arg)
     if (epoll_ctl(ep->fd, opcode, fd, &ev) < 0) {
         fprintf(stderr, "Error epoll add fd %d error. reason:%s\n", fd,
                 strerror(errno));
+        ep->fdtab[fd].events &= ~events;
         return -1;
     }
 
-    ep->fdtab[fd].cb[mod].arg = arg;
-
     return 0;
 }
 
 static int dns_perf_epoll_is_fdset(int fd, int mod)
 {
+    if (fd >= ep->fd_size) {
+        return 0;
+    }
+
     if(((mod == MOD_RD) && ((ep->fdtab[fd].events & EPOLLIN) == EPOLLIN)) ||
        ((mod == MOD_WR) && ((ep->fdtab[fd].events & EPOLLOUT) == EPOLLOUT)))
     {
@@ -237,7 +334,223 @@ static dns_perf_eventsys_t dns_perf_epoll_eventsys = {
     dns_perf_epoll_clear_fd,
     dns_perf_epoll_destroy,
     dns_perf_epoll_get_obj_by_fd,
-    dns_perf_epoll_is_fdset
+    dns_perf_epoll_is_fdset,
+    NULL,
+    NULL,
+    NULL
+};
+
+/*
+ * epoll-et: every fd is added once, edge triggered, and stays in the
+ * epoll set until it is closed. Watching or not is only a flag in fdtab,
+ * EPOLLOUT is the only change the kernel hears of and only when a write
+ * would block. An edge which comes while nobody watches, or which a
+ * callback did not read to the end, is remembered in fdtab.ready and
+ * dispatched from the pending list without waiting.
+ */
+
+#define EPOLL_QUEUED  0x40000000  /* fdtab.ready: fd is in ep->pending */
+
+static int dns_perf_epollet_ctl(int fd, int events)
+{
+    struct epoll_event ev;
+    int                opcode;
+
+    opcode = ep->fdtab[fd].registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+    ev.data.fd = fd;
+    ev.events = events | EPOLLET;
+
+    if (epoll_ctl(ep->fd, opcode, fd, &ev) < 0) {
+        fprintf(stderr, "Error epoll add fd %d error. reason:%s\n", fd,
+                strerror(errno));
+        return -1;
+    }
+
+    ep->fdtab[fd].registered = events;
+
+    return 0;
+}
+
+static void dns_perf_epollet_queue(int fd)
+{
+    if (ep->fdtab[fd].ready & EPOLL_QUEUED) {
+        return;
+    }
+
+    ep->fdtab[fd].ready |= EPOLL_QUEUED;
+    ep->pending[ep->npending++] = fd;
+}
+
+static int dns_perf_epollet_set_fd(int fd, int mod, void *arg)
+{
+    int  events, registered;
+
+    if (dns_perf_epoll_expand(fd) == -1) {
+        return -1;
+    }
+
+    if (mod == MOD_RD) {
+        events = EPOLLIN;
+    } else if (mod == MOD_WR) {
+        events = EPOLLOUT;
+    } else {
+        return -1;
+    }
+
+    ep->fdtab[fd].cb[mod].arg = arg;
+
+    /* reading is always watched by the kernel, writing only on demand */
+    registered = ep->fdtab[fd].registered;
+    if ((registered & (events | EPOLLIN)) != (events | EPOLLIN)) {
+        if (dns_perf_epollet_ctl(fd, registered | events | EPOLLIN) == -1) {
+            return -1;
+        }
+    }
+
+    ep->fdtab[fd].events |= events;
+
+    if (ep->fdtab[fd].ready & events) {
+        dns_perf_epollet_queue(fd);
+    }
+
+    return 0;
+}
+
+static int dns_perf_epollet_clear_fd(int fd, int mod)
+{
+    if (fd >= ep->fd_size) {
+        return 0;
+    }
+
+    if (mod == MOD_RD) {
+        ep->fdtab[fd].events &= ~EPOLLIN;
+    } else if (mod == MOD_WR) {
+        ep->fdtab[fd].events &= ~EPOLLOUT;
+    }
+
+    ep->fdtab[fd].cb[mod].arg = NULL;
+
+    return 0;
+}
+
+static int dns_perf_epollet_del_fd(int fd)
+{
+    if (fd >= ep->fd_size) {
+        return 0;
+    }
+
+    /*
+     * close() takes the fd out of the epoll set. A queued fd stays in
+     * the pending list, so the flag is kept for a socket reusing it.
+     */
+    ep->fdtab[fd].events = 0;
+    ep->fdtab[fd].ready &= EPOLL_QUEUED;
+    ep->fdtab[fd].registered = 0;
+    ep->fdtab[fd].cb[MOD_RD].arg = NULL;
+    ep->fdtab[fd].cb[MOD_WR].arg = NULL;
+
+    return 0;
+}
+
+/*
+ * dns_perf_epollet_call:
+ *     dispatch the ready directions of `fd' somebody watches. A callback
+ *     may open sockets and so move fdtab, it is looked up again after.
+ */
+static void dns_perf_epollet_call(int fd)
+{
+    dns_perf_event_ops_t *op;
+    struct fddata        *fdd = &ep->fdtab[fd];
+
+    if (fdd->ready & fdd->events & EPOLLOUT) {
+        op = (dns_perf_event_ops_t *) fdd->cb[MOD_WR].arg;
+        fdd->ready &= ~EPOLLOUT;
+        dns_perf_epollet_clear_fd(fd, MOD_WR);
+        op->send((void *) op);
+
+        /* nobody waits to write any more, stop the EPOLLOUT edges */
+        fdd = &ep->fdtab[fd];
+        if (!(fdd->events & EPOLLOUT) && (fdd->registered & EPOLLOUT)) {
+            dns_perf_epollet_ctl(fd, EPOLLIN);
+        }
+    }
+
+    if (fdd->ready & fdd->events & EPOLLIN) {
+        op = (dns_perf_event_ops_t *) fdd->cb[MOD_RD].arg;
+        fdd->ready &= ~EPOLLIN;
+        dns_perf_epollet_clear_fd(fd, MOD_RD);
+
+        if (op->recv((void *) op) > 0) {
+            /* stopped before reading all there is, no new edge comes */
+            fdd = &ep->fdtab[fd];
+            fdd->ready |= EPOLLIN;
+            if (fdd->events & EPOLLIN) {
+                dns_perf_epollet_queue(fd);
+            }
+        }
+    }
+}
+
+static int dns_perf_epollet_do_wait(long timeout)
+{
+    int i, n, fd, nevents, events;
+
+    nevents = epoll_wait(ep->fd, ep->events, MAX_EVENTS,
+                         ep->npending ? 0 : timeout);
+
+    if (nevents < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+
+        fprintf(stderr, "epoll_wait error:%s\n", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < nevents; i++) {
+        fd = ep->events[i].data.fd;
+        events = ep->events[i].events;
+
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            events |= EPOLLIN | EPOLLOUT;
+        }
+
+        ep->fdtab[fd].ready |= events & (EPOLLIN | EPOLLOUT);
+        dns_perf_epollet_call(fd);
+    }
+
+    /* what the callbacks queue now waits for the next round */
+    n = ep->npending;
+
+    for (i = 0; i < n; i++) {
+        fd = ep->pending[i];
+
+        if (ep->fdtab[fd].ready & EPOLL_QUEUED) {
+            ep->fdtab[fd].ready &= ~EPOLL_QUEUED;
+            dns_perf_epollet_call(fd);
+        }
+    }
+
+    ep->npending -= n;
+    memmove(ep->pending, ep->pending + n, ep->npending * sizeof(int));
+
+    return 0;
+}
+
+
+static dns_perf_eventsys_t dns_perf_epollet_eventsys = {
+    "epoll-et",
+    dns_perf_epoll_init,
+    dns_perf_epollet_do_wait,
+    dns_perf_epollet_set_fd,
+    dns_perf_epollet_clear_fd,
+    dns_perf_epoll_destroy,
+    dns_perf_epoll_get_obj_by_fd,
+    dns_perf_epoll_is_fdset,
+    dns_perf_epollet_del_fd,
+    NULL,
+    NULL
 };
 
 #endif  /* HAVE_EPOLL */
@@ -253,7 +566,8 @@ typedef struct dns_perf_kqueue_data_s {
     int            evtlist_size;
 } dns_perf_kqueue_data_t;
 
-static dns_perf_kqueue_data_t *kq = NULL;
+/* every worker thread has its own kqueue */
+static __thread dns_perf_kqueue_data_t *kq = NULL;
 
 static int dns_perf_kqueue_init()
 {
@@ -270,7 +584,7 @@ static int dns_perf_kqueue_init()
         goto fail_kqueue;
     }
 
-    kq->fd_size = MAX_EVENT_SOCKS;
+    kq->fd_size = EVENT_FD_SIZE;
     if ((kq->fdtab = (struct fddata*) calloc(kq->fd_size,
                                              sizeof(struct fddata))) == NULL)
     {
@@ -285,7 +599,7 @@ static int dns_perf_kqueue_init()
         goto fail_monlist;
     }
 
-    kq->evtlist_size = kq->fd_size;
+    kq->evtlist_size = MAX_EVENTS;
     if ((kq->evtlist = (struct kevent*) calloc(kq->evtlist_size,
                                                sizeof(struct kevent))) == NULL)
     {
@@ -312,6 +626,7 @@ static int dns_perf_kqueue_init()
 static int dns_perf_kqueue_destroy()
 {
     free(kq->fdtab);
+    free(kq->monlist);
     free(kq->evtlist);
     close(kq->fd);
     free(kq);
@@ -319,8 +634,35 @@ static int dns_perf_kqueue_destroy()
     return 0;
 }
 
+static int dns_perf_kqueue_expand(int fd)
+{
+    int size;
+
+    if (fd < kq->fd_size) {
+        return 0;
+    }
+
+    size = dns_perf_events_size(kq->fd_size, fd);
+
+    if (dns_perf_events_grow((void **) &kq->fdtab, kq->fd_size, size,
+                             sizeof(struct fddata)) == -1
+        || dns_perf_events_grow((void **) &kq->monlist, kq->fd_size, size,
+                                sizeof(struct kevent)) == -1)
+    {
+        return -1;
+    }
+
+    kq->fd_size = size;
+
+    return 0;
+}
+
 static void *dns_perf_kqueue_get_obj_by_fd(int fd, int mod)
 {
+    if (fd >= kq->fd_size) {
+        return NULL;
+    }
+
     return kq->fdtab[fd].cb[mod].arg;
 }
 
@@ -338,6 +680,10 @@ static int dns_perf_kqueue_clear_fd(int fd, int mod)
         return -1;
     }
 
+    if (fd >= kq->fd_size) {
+        return 0;
+    }
+
     kq->fdtab[fd].events &= ~filter;
 
     EV_SET(&kq->monlist[fd], fd, filter, EV_DELETE, 0, 0, 0);
@@ -353,7 +699,7 @@ static int dns_perf_kqueue_do_kevent(long timeout)
     struct timespec ts, *tsp;
     dns_perf_event_ops_t *op;
 
-    if (timeout == 0) {
+    if (timeout < 0) {
         tsp = NULL;
     } else {
         ts.tv_sec = (time_t) timeout / 1000;
@@ -361,10 +707,15 @@ static int dns_perf_kqueue_do_kevent(long timeout)
         tsp = &ts;
     }
 
-    nevents = kevent(kq->fd, kq->monlist, kq->fd_size, kq->evtlist, kq->fd_size, tsp);
+    nevents = kevent(kq->fd, kq->monlist, kq->fd_size, kq->evtlist,
+                     kq->evtlist_size, tsp);
 
     if (nevents < 0) {
-        fprintf(stderr, "kevent error:%s", strerror(errno));
+        if (errno == EINTR) {
+            return 0;
+        }
+
+        fprintf(stderr, "kevent error:%s\n", strerror(errno));
         return -1;
     }
 
@@ -399,8 +750,8 @@ static int dns_perf_kqueue_set_fd(int fd, int mod, void *arg)
     int             filter;
 
 
-    if (fd > kq->fd_size) {
-        //TODO: expand lists
+    if (dns_perf_kqueue_expand(fd) == -1) {
+        return -1;
     }
 
     if (mod == MOD_RD) {
@@ -435,6 +786,10 @@ static int dns_perf_kqueue_set_fd(int fd, int mod, void *arg)
 
 static int dns_perf_kqueue_is_fdset(int fd, int mod)
 {
+    if (fd >= kq->fd_size) {
+        return 0;
+    }
+
     if(((mod == MOD_RD) && ((kq->fdtab[fd].events & EVFILT_READ) == EVFILT_READ)) ||
        ((mod == MOD_WR) && ((kq->fdtab[fd].events & EVFILT_WRITE) == EVFILT_WRITE)))
     {
@@ -446,28 +801,705 @@ static int dns_perf_kqueue_is_fdset(int fd, int mod)
 
 
 static dns_perf_eventsys_t dns_perf_kqueue_eventsys = {
-    "epoll",
+    "kqueue",
     dns_perf_kqueue_init,
     dns_perf_kqueue_do_kevent,
     dns_perf_kqueue_set_fd,
     dns_perf_kqueue_clear_fd,
     dns_perf_kqueue_destroy,
     dns_perf_kqueue_get_obj_by_fd,
-    dns_perf_kqueue_is_fdset
+    dns_perf_kqueue_is_fdset,
+    NULL,
+    NULL,
+    NULL
 };
 
 #endif /* HAVE_KQUEUE */
 
-int dns_perf_set_event_sys() {
-    int set = -1;
+#ifdef HAVE_IO_URING
+
+#define URING_ENTRIES    4096    /* submission queue */
+#define URING_BUF_COUNT  1024    /* provided receive buffers, power of 2 */
+#define URING_BGID       0
+#define URING_SEND_IOV   4       /* iovecs of one send */
+
+/* fdtab events */
+#define URING_EV_RD      1
+#define URING_EV_WR      2
+
+/*
+ * user_data of a request is generation << 32 | fd << 2 | kind, a
+ * completion whose user_data is no longer in `armed' is stale.
+ */
+#define URING_POLL_RD    MOD_RD
+#define URING_POLL_WR    MOD_WR
+#define URING_RECV       2
+#define URING_IGNORE     3       /* sends and cancels */
+
+typedef struct dns_perf_uring_data_s {
+    int                       fd;        /* io_uring fd */
+    struct fddata            *fdtab;
+    uint64_t                (*armed)[2]; /* request watching fd, per mod */
+    int                       fd_size;
+    uint32_t                  gen;
+
+    /* submission queue */
+    unsigned int             *sq_head;
+    unsigned int             *sq_tail;
+    unsigned int             *sq_mask;
+    unsigned int             *sq_array;
+    unsigned int              sq_entries;
+    unsigned int              sq_local;  /* tail not submitted yet */
+    struct io_uring_sqe      *sqes;
+    struct msghdr            *msgs;      /* of the sends, per sqe */
+    struct iovec            (*iovs)[URING_SEND_IOV];
+
+    /* completion queue */
+    unsigned int             *cq_head;
+    unsigned int             *cq_tail;
+    unsigned int             *cq_mask;
+    struct io_uring_cqe      *cqes;
+
+    void                     *sq_ring;
+    void                     *cq_ring;
+    size_t                    sq_ring_size;
+    size_t                    cq_ring_size;
+    size_t                    sqes_size;
+
+    /* buffers of multishot receives, 0 if receiving by readiness */
+    int                       multishot;
+    struct io_uring_buf_ring *br;
+    unsigned short            br_tail;
+    unsigned char            *bufs;
+} dns_perf_uring_data_t;
+
+/* every worker thread has its own ring */
+static __thread dns_perf_uring_data_t *ur = NULL;
+
+
+static int dns_perf_uring_enter(unsigned int wait, long timeout)
+{
+    struct io_uring_getevents_arg  arg;
+    struct __kernel_timespec       ts;
+    unsigned int                   submit, flags = 0;
+    void                          *argp = NULL;
+    size_t                         argsz = 0;
+
+    __atomic_store_n(ur->sq_tail, ur->sq_local, __ATOMIC_RELEASE);
+    submit = ur->sq_local - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+
+    if (wait) {
+        memset(&arg, 0, sizeof(arg));
+
+        if (timeout >= 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000;
+            arg.ts = (uint64_t) (uintptr_t) &ts;
+        }
+
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
 
+    } else if (submit == 0) {
+        return 0;
+    }
+
+    if (syscall(__NR_io_uring_enter, ur->fd, submit, wait, flags, argp, argsz) < 0
+        && errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY)
+    {
+        fprintf(stderr, "io_uring_enter error:%s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static struct io_uring_sqe *dns_perf_uring_get_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int         index;
+
+    if (ur->sq_local - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE)
+        >= ur->sq_entries)
+    {
+        /* full, hand what is queued to the kernel */
+        dns_perf_uring_enter(0, 0);
+
+        if (ur->sq_local - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE)
+            >= ur->sq_entries)
+        {
+            fprintf(stderr, "Error io_uring submission queue full\n");
+            return NULL;
+        }
+    }
+
+    index = ur->sq_local & *ur->sq_mask;
+    ur->sq_array[index] = index;
+    ur->sq_local++;
+
+    sqe = &ur->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    return sqe;
+}
+
+static uint64_t dns_perf_uring_user_data(int fd, int kind)
+{
+    return (uint64_t) ++ur->gen << 32 | (uint64_t) fd << 2 | kind;
+}
+
+static void dns_perf_uring_buf_add(unsigned short bid)
+{
+    struct io_uring_buf  *buf;
+
+    buf = &ur->br->bufs[ur->br_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uint64_t) (uintptr_t) (ur->bufs + (size_t) bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+
+    ur->br_tail++;
+    __atomic_store_n(&ur->br->tail, ur->br_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * dns_perf_uring_buf_init:
+ *     register the provided buffer ring multishot receives read into,
+ *     receiving falls back to readiness if the kernel has none.
+ */
+static void dns_perf_uring_buf_init(void)
+{
+    struct io_uring_buf_reg  reg;
+    int                      i;
+
+    ur->br = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf),
+                  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ur->br == MAP_FAILED) {
+        ur->br = NULL;
+        return;
+    }
+
+    if ((ur->bufs = malloc((size_t) URING_BUF_COUNT * URING_BUF_SIZE)) == NULL) {
+        return;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) ur->br;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BGID;
+
+    if (syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0)
+    {
+        return;
+    }
+
+    for (i = 0; i < URING_BUF_COUNT; i++) {
+        dns_perf_uring_buf_add(i);
+    }
+
+    ur->multishot = 1;
+}
+
+static int dns_perf_uring_destroy(void)
+{
+    if (ur == NULL) {
+        return 0;
+    }
+
+    /* closing the ring cancels all of its requests */
+    if (ur->sqes) {
+        munmap(ur->sqes, ur->sqes_size);
+    }
+
+    if (ur->cq_ring && ur->cq_ring != ur->sq_ring) {
+        munmap(ur->cq_ring, ur->cq_ring_size);
+    }
+
+    if (ur->sq_ring) {
+        munmap(ur->sq_ring, ur->sq_ring_size);
+    }
+
+    if (ur->fd >= 0) {
+        close(ur->fd);
+    }
+
+    if (ur->br) {
+        munmap(ur->br, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    }
+
+    free(ur->bufs);
+    free(ur->msgs);
+    free(ur->iovs);
+    free(ur->armed);
+    free(ur->fdtab);
+    free(ur);
+    ur = NULL;
+
+    return 0;
+}
+
+static int dns_perf_uring_init(void)
+{
+    struct io_uring_params  p;
+    char                   *sq, *cq;
+
+    if ((ur = calloc(1, sizeof(dns_perf_uring_data_t))) == NULL) {
+        fprintf(stderr, "Error memory low");
+        return -1;
+    }
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_ENTRIES * 4;
+
+    if ((ur->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0) {
+        fprintf(stderr, "Error call io_uring_setup: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "Error io_uring of this kernel can not wait with timeout\n");
+        goto fail;
+    }
+
+    ur->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ur->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ur->cq_ring_size > ur->sq_ring_size) {
+            ur->sq_ring_size = ur->cq_ring_size;
+        }
+        ur->cq_ring_size = ur->sq_ring_size;
+    }
+
+    ur->sq_ring = mmap(NULL, ur->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+    if (ur->sq_ring == MAP_FAILED) {
+        ur->sq_ring = NULL;
+        fprintf(stderr, "Error map io_uring: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ur->cq_ring = ur->sq_ring;
+
+    } else {
+        ur->cq_ring = mmap(NULL, ur->cq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+        if (ur->cq_ring == MAP_FAILED) {
+            ur->cq_ring = NULL;
+            fprintf(stderr, "Error map io_uring: %s\n", strerror(errno));
+            goto fail;
+        }
+    }
+
+    ur->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+    if (ur->sqes == MAP_FAILED) {
+        ur->sqes = NULL;
+        fprintf(stderr, "Error map io_uring: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    sq = ur->sq_ring;
+    ur->sq_head = (unsigned int *) (sq + p.sq_off.head);
+    ur->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+    ur->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+    ur->sq_array = (unsigned int *) (sq + p.sq_off.array);
+    ur->sq_entries = p.sq_entries;
+    ur->sq_local = *ur->sq_tail;
+
+    cq = ur->cq_ring;
+    ur->cq_head = (unsigned int *) (cq + p.cq_off.head);
+    ur->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+    ur->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    ur->msgs = calloc(ur->sq_entries, sizeof(struct msghdr));
+    ur->iovs = calloc(ur->sq_entries, sizeof(*ur->iovs));
+
+    ur->fd_size = EVENT_FD_SIZE;
+    ur->fdtab = calloc(ur->fd_size, sizeof(struct fddata));
+    ur->armed = calloc(ur->fd_size, sizeof(*ur->armed));
+
+    if (ur->fdtab == NULL || ur->armed == NULL || ur->msgs == NULL
+        || ur->iovs == NULL)
+    {
+        fprintf(stderr, "Error: alloc fddata failure.");
+        goto fail;
+    }
+
+    dns_perf_uring_buf_init();
+
+    return 0;
+
+ fail:
+    dns_perf_uring_destroy();
+    return -1;
+}
+
+static int dns_perf_uring_expand(int fd)
+{
+    int size;
+
+    if (fd < ur->fd_size) {
+        return 0;
+    }
+
+    size = dns_perf_events_size(ur->fd_size, fd);
+
+    if (dns_perf_events_grow((void **) &ur->fdtab, ur->fd_size, size,
+                             sizeof(struct fddata)) == -1
+        || dns_perf_events_grow((void **) &ur->armed, ur->fd_size, size,
+                                sizeof(*ur->armed)) == -1)
+    {
+        return -1;
+    }
+
+    ur->fd_size = size;
+
+    return 0;
+}
+
+static int dns_perf_uring_set_fd(int fd, int mod, void *arg)
+{
+    struct io_uring_sqe *sqe;
+    int                  events;
+
+    if (dns_perf_uring_expand(fd) == -1) {
+        return -1;
+    }
+
+    if (mod == MOD_RD) {
+        events = URING_EV_RD;
+    } else if (mod == MOD_WR) {
+        events = URING_EV_WR;
+    } else {
+        return -1;
+    }
+
+    ur->fdtab[fd].cb[mod].arg = arg;
+
+    if (ur->fdtab[fd].events & events) {
+        return 0;
+    }
+
+    if ((sqe = dns_perf_uring_get_sqe()) == NULL) {
+        return -1;
+    }
+
+    /* one shot, like the other event systems are used */
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = (mod == MOD_RD) ? POLLIN : POLLOUT;
+    sqe->user_data = dns_perf_uring_user_data(fd, mod);
+
+    ur->armed[fd][mod] = sqe->user_data;
+    ur->fdtab[fd].events |= events;
+
+    return 0;
+}
+
+static int dns_perf_uring_clear_fd(int fd, int mod)
+{
+    struct io_uring_sqe *sqe;
+    uint64_t             armed;
+
+    if (fd >= ur->fd_size) {
+        return 0;
+    }
+
+    armed = ur->armed[fd][mod];
+    ur->fdtab[fd].events &= ~(mod == MOD_RD ? URING_EV_RD : URING_EV_WR);
+    ur->fdtab[fd].cb[mod].arg = NULL;
+    ur->armed[fd][mod] = 0;
+
+    if (armed == 0) {
+        return 0;
+    }
+
+    if ((sqe = dns_perf_uring_get_sqe()) == NULL) {
+        return -1;
+    }
+
+    if ((armed & 3) == URING_RECV) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    } else {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+    }
+
+    sqe->fd = -1;
+    sqe->addr = armed;
+    sqe->user_data = URING_IGNORE;
+
+    return 0;
+}
+
+static int dns_perf_uring_recv_arm(int fd)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = dns_perf_uring_get_sqe()) == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = dns_perf_uring_user_data(fd, URING_RECV);
+
+    ur->armed[fd][MOD_RD] = sqe->user_data;
+
+    return 0;
+}
+
+/*
+ * dns_perf_uring_recv_start:
+ *     read every datagram arriving on `fd' into a provided buffer and
+ *     pass it to the recv_data callback of `arg', one request serves the
+ *     socket until it is cleared.
+ */
+static int dns_perf_uring_recv_start(int fd, void *arg)
+{
+    if (!ur->multishot || dns_perf_uring_expand(fd) == -1) {
+        return -1;
+    }
+
+    if (dns_perf_uring_recv_arm(fd) == -1) {
+        return -1;
+    }
+
+    ur->fdtab[fd].cb[MOD_RD].arg = arg;
+    ur->fdtab[fd].events |= URING_EV_RD;
+
+    return 0;
+}
+
+static int dns_perf_uring_send(int fd, struct iovec *iov, int iovcnt)
+{
+    struct io_uring_sqe *sqe;
+    struct msghdr       *msg;
+    unsigned int         index;
+
+    if (iovcnt > URING_SEND_IOV) {
+        return -1;
+    }
+
+    if ((sqe = dns_perf_uring_get_sqe()) == NULL) {
+        return -1;
+    }
+
+    /*
+     * The header lives with the sqe slot, the kernel has read it by the
+     * time the slot is handed out again.
+     */
+    index = sqe - ur->sqes;
+    msg = &ur->msgs[index];
+    memcpy(ur->iovs[index], iov, iovcnt * sizeof(struct iovec));
+
+    memset(msg, 0, sizeof(struct msghdr));
+    msg->msg_iov = ur->iovs[index];
+    msg->msg_iovlen = iovcnt;
+
+    /* submitted with the next wait, a failed send times out */
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) msg;
+    sqe->len = 1;
+    sqe->user_data = URING_IGNORE;
+
+    return 0;
+}
+
+static void dns_perf_uring_recv_done(int fd, uint64_t user_data, int res,
+    unsigned int flags)
+{
+    dns_perf_event_ops_t *op;
+    unsigned char        *buf = NULL;
+    int                   bid = -1;
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        buf = ur->bufs + (size_t) bid * URING_BUF_SIZE;
+    }
+
+    if (ur->armed[fd][MOD_RD] == user_data) {
+        op = (dns_perf_event_ops_t *) ur->fdtab[fd].cb[MOD_RD].arg;
+
+        if (res == -EINVAL) {
+            /* no multishot receive in this kernel, poll instead */
+            ur->multishot = 0;
+            ur->armed[fd][MOD_RD] = 0;
+            ur->fdtab[fd].events &= ~URING_EV_RD;
+            dns_perf_uring_set_fd(fd, MOD_RD, op);
+
+        } else if (res > 0 && buf != NULL) {
+            op->recv_data((void *) op, buf, res);
+        }
+
+        /* the callback may have closed the socket */
+        if (!(flags & IORING_CQE_F_MORE) && ur->armed[fd][MOD_RD] == user_data) {
+            dns_perf_uring_recv_arm(fd);
+        }
+    }
+
+    if (bid != -1) {
+        dns_perf_uring_buf_add(bid);
+    }
+}
+
+static int dns_perf_uring_dispatch(long timeout)
+{
+    struct io_uring_cqe  *cqe;
+    dns_perf_event_ops_t *op;
+    unsigned int          head, tail, flags;
+    uint64_t              user_data;
+    int                   res, fd, mod, wait;
+
+    head = *ur->cq_head;
+    wait = (timeout != 0
+            && head == __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE));
+
+    if (dns_perf_uring_enter(wait, timeout) == -1) {
+        return -1;
+    }
+
+    tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+
+    for ( ; head != tail; head++) {
+        cqe = &ur->cqes[head & *ur->cq_mask];
+        user_data = cqe->user_data;
+        res = cqe->res;
+        flags = cqe->flags;
+
+        /* the slot is free again before the callbacks queue more work */
+        __atomic_store_n(ur->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if (user_data == URING_IGNORE) {
+            continue;
+        }
+
+        fd = (user_data >> 2) & 0x3fffffff;
+        mod = user_data & 3;
+
+        if (mod == URING_RECV) {
+            dns_perf_uring_recv_done(fd, user_data, res, flags);
+            continue;
+        }
+
+        if (ur->armed[fd][mod] != user_data) {
+            continue;  /* removed by clear_fd */
+        }
+
+        op = (dns_perf_event_ops_t *) ur->fdtab[fd].cb[mod].arg;
+        ur->armed[fd][mod] = 0;
+        dns_perf_uring_clear_fd(fd, mod);
+
+        if (mod == MOD_WR) {
+            op->send((void *) op);
+        } else {
+            op->recv((void *) op);
+        }
+    }
+
+    return 0;
+}
+
+static void *dns_perf_uring_get_obj_by_fd(int fd, int mod)
+{
+    if (fd >= ur->fd_size) {
+        return NULL;
+    }
+
+    return ur->fdtab[fd].cb[mod].arg;
+}
+
+static int dns_perf_uring_is_fdset(int fd, int mod)
+{
+    if (fd >= ur->fd_size) {
+        return 0;
+    }
+
+    if (((mod == MOD_RD) && (ur->fdtab[fd].events & URING_EV_RD)) ||
+        ((mod == MOD_WR) && (ur->fdtab[fd].events & URING_EV_WR)))
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static dns_perf_eventsys_t dns_perf_uring_eventsys = {
+    "io_uring",
+    dns_perf_uring_init,
+    dns_perf_uring_dispatch,
+    dns_perf_uring_set_fd,
+    dns_perf_uring_clear_fd,
+    dns_perf_uring_destroy,
+    dns_perf_uring_get_obj_by_fd,
+    dns_perf_uring_is_fdset,
+    NULL,
+    dns_perf_uring_recv_start,
+    dns_perf_uring_send
+};
+
+#endif /* HAVE_IO_URING */
+
+/* the first one is the default */
+static dns_perf_eventsys_t *dns_perf_eventsys_list[] = {
 #ifdef HAVE_EPOLL
-    dns_perf_eventsys = &dns_perf_epoll_eventsys;
-    set = 0;
-#elif defined HAVE_KQUEUE
-    dns_perf_eventsys = &dns_perf_kqueue_eventsys;
-    set = 0;
+    &dns_perf_epoll_eventsys,
+    &dns_perf_epollet_eventsys,
+#endif
+#ifdef HAVE_KQUEUE
+    &dns_perf_kqueue_eventsys,
 #endif
+#ifdef HAVE_IO_URING
+    &dns_perf_uring_eventsys,
+#endif
+    NULL
+};
+
+/*
+ * dns_perf_eventsys_del_fd:
+ *     stop watching `fd' before it is closed.
+ */
+int dns_perf_eventsys_del_fd(int fd)
+{
+    if (dns_perf_eventsys->del_fd != NULL) {
+        return dns_perf_eventsys->del_fd(fd);
+    }
 
-    return set;
+    if (dns_perf_eventsys_is_fdset(fd, MOD_RD)) {
+        dns_perf_eventsys_clear_fd(fd, MOD_RD);
+    }
+
+    if (dns_perf_eventsys_is_fdset(fd, MOD_WR)) {
+        dns_perf_eventsys_clear_fd(fd, MOD_WR);
+    }
+
+    return 0;
+}
+
+/*
+ * dns_perf_set_event_sys:
+ *     use the event system called `name', the default one if NULL.
+ */
+int dns_perf_set_event_sys(const char *name)
+{
+    dns_perf_eventsys_t **es;
+
+    for (es = dns_perf_eventsys_list; *es != NULL; es++) {
+        if (name == NULL || strcmp((*es)->name, name) == 0) {
+            dns_perf_eventsys = *es;
+            return 0;
+        }
+    }
+
+    return -1;
 }
@@ -7,17 +7,22 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/resource.h>
 
 
 #define MOD_RD   0
 #define MOD_WR   1
 
-#define MAX_EVENT_SOCKS  10000
+#define EVENT_FD_SIZE    1024    /* fd tables start so, and double */
+#define MAX_EVENTS       4096    /* events handled by one wait */
+#define URING_BUF_SIZE   4096    /* longer datagrams are truncated */
 
 /* info about one given fd */
 struct fddata {
     int events;
+    int ready;        /* epoll-et: edges not dispatched yet */
+    int registered;   /* epoll-et: events the kernel watches */
     struct {
         void  *arg;
     } cb[2];
@@ -25,7 +30,10 @@ struct fddata {
 
 typedef struct dns_perf_event_ops_s {
     int (*send)(void *arg);
-    int (*recv)(void *arg);
+    int (*recv)(void *arg);   /* 1: stopped before reading everything */
+
+    /* a datagram read by the event system, see recv_start */
+    int (*recv_data)(void *arg, unsigned char *buf, int len);
 } dns_perf_event_ops_t;
 
 
@@ -38,18 +46,27 @@ typedef struct dns_perf_eventsys_s {
     int   (*destroy)(void);
     void *(*get_obj_by_fd)(int fd, int mod);
     int   (*is_fdset)(int fd, int mod);
+    int   (*del_fd)(int fd);   /* NULL: clear_fd what is set */
+
+    /* completion based I/O, NULL if the event system only tells readiness */
+    int   (*recv_start)(int fd, void *arg);
+    int   (*send)(int fd, struct iovec *iov, int iovcnt);
 } dns_perf_eventsys_t;
 
 
 extern dns_perf_eventsys_t *dns_perf_eventsys;
 
-int dns_perf_set_event_sys();
+int dns_perf_set_event_sys(const char *name);
+int dns_perf_eventsys_del_fd(int fd);
 #define dns_perf_eventsys_init()                 dns_perf_eventsys->init()
 #define dns_perf_eventsys_destroy()              dns_perf_eventsys->destroy()
 #define dns_perf_eventsys_dispatch(t)            dns_perf_eventsys->dispatch(t)
-#define dns_perf_eventsys_is_fdset(fd)           dns_perf_eventsys->is_fdset(fd)
+#define dns_perf_eventsys_is_fdset(fd, mod)      dns_perf_eventsys->is_fdset(fd, mod)
 #define dns_perf_eventsys_clear_fd(fd, mod)      dns_perf_eventsys->clear_fd(fd, mod)
 #define dns_perf_eventsys_set_fd(fd, mod, obj)   dns_perf_eventsys->set_fd(fd, mod, obj)
 #define dns_perf_eventsys_get_obj_by_fd(fd, mod) dns_perf_eventsys->get_obj_by_fd(fd, mod)
+#define dns_perf_eventsys_completion()           (dns_perf_eventsys->recv_start != NULL)
+#define dns_perf_eventsys_recv_start(fd, obj)    dns_perf_eventsys->recv_start(fd, obj)
+#define dns_perf_eventsys_send(fd, iov, n)       dns_perf_eventsys->send(fd, iov, n)
 
 #endif
@@ -0,0 +1,208 @@
+/*
+ * This file if part of dnsperf.
+ *
+ * Copyright (C) 2014 Cobblau
+ *
+ * dnsperf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dnsperf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <histogram.h>
+
+
+static int dns_perf_histogram_index(uint64_t value)
+{
+    int  msb, shift;
+
+    if (value < HISTOGRAM_SUB_COUNT) {
+        return (int) value;
+    }
+
+    if (value >= ((uint64_t) 1 << HISTOGRAM_MAX_BITS)) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+
+    msb = 63 - __builtin_clzll(value);
+    shift = msb - (HISTOGRAM_SUB_BITS - 1);
+
+    return HISTOGRAM_SUB_COUNT + (shift - 1) * HISTOGRAM_HALF_COUNT
+           + (int) (value >> shift) - HISTOGRAM_HALF_COUNT;
+}
+
+/*
+ * dns_perf_histogram_value:
+ *     the middle of the values counted by bucket `index'.
+ */
+static uint64_t dns_perf_histogram_value(int index)
+{
+    int  shift;
+
+    if (index < HISTOGRAM_SUB_COUNT) {
+        return index;
+    }
+
+    index -= HISTOGRAM_SUB_COUNT;
+    shift = index / HISTOGRAM_HALF_COUNT + 1;
+
+    return ((uint64_t) (index % HISTOGRAM_HALF_COUNT + HISTOGRAM_HALF_COUNT) << shift)
+           + ((uint64_t) 1 << (shift - 1));
+}
+
+/*
+ * dns_perf_histogram_bucket_range:
+ *     the values counted by bucket `index' are in [*low, *high).
+ */
+void dns_perf_histogram_bucket_range(int index, uint64_t *low, uint64_t *high)
+{
+    int  shift;
+
+    if (index < HISTOGRAM_SUB_COUNT) {
+        *low = index;
+        *high = index + 1;
+        return;
+    }
+
+    index -= HISTOGRAM_SUB_COUNT;
+    shift = index / HISTOGRAM_HALF_COUNT + 1;
+
+    *low = (uint64_t) (index % HISTOGRAM_HALF_COUNT + HISTOGRAM_HALF_COUNT) << shift;
+    *high = *low + ((uint64_t) 1 << shift);
+}
+
+void dns_perf_histogram_init(dns_perf_histogram_t *h)
+{
+    memset(h, 0, sizeof(dns_perf_histogram_t));
+    h->min = UINT64_MAX;
+}
+
+void dns_perf_histogram_record(dns_perf_histogram_t *h, uint64_t value)
+{
+    h->buckets[dns_perf_histogram_index(value)]++;
+    h->count++;
+    h->sum += value;
+
+    if (value < h->min) {
+        h->min = value;
+    }
+
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+void dns_perf_histogram_merge(dns_perf_histogram_t *dst, dns_perf_histogram_t *src)
+{
+    int  i;
+
+    if (src->count == 0) {
+        return;
+    }
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+
+    if (src->min < dst->min) {
+        dst->min = src->min;
+    }
+
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+/*
+ * dns_perf_histogram_sub:
+ *     remove the values of `src', an earlier copy of `dst', from `dst'.
+ *     The exact min and max are lost, they become the values of the
+ *     outermost buckets left.
+ */
+void dns_perf_histogram_sub(dns_perf_histogram_t *dst, dns_perf_histogram_t *src)
+{
+    int  i, first = -1, last = -1;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        dst->buckets[i] -= src->buckets[i];
+
+        if (dst->buckets[i] != 0) {
+            if (first == -1) {
+                first = i;
+            }
+            last = i;
+        }
+    }
+
+    dst->count -= src->count;
+    dst->sum -= src->sum;
+
+    if (first == -1) {
+        dst->min = UINT64_MAX;
+        dst->max = 0;
+        return;
+    }
+
+    dst->min = dns_perf_histogram_value(first);
+    dst->max = dns_perf_histogram_value(last);
+}
+
+/*
+ * dns_perf_histogram_percentile:
+ *     the value below which `percentile' percent of the values fall,
+ *     clamped to the exact min and max.
+ */
+uint64_t dns_perf_histogram_percentile(dns_perf_histogram_t *h, double percentile)
+{
+    uint64_t  rank, seen, value;
+    int       i;
+
+    if (h->count == 0) {
+        return 0;
+    }
+
+    rank = (uint64_t) (percentile / 100.0 * h->count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    seen = 0;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+
+    value = dns_perf_histogram_value(i);
+
+    if (value < h->min) {
+        return h->min;
+    }
+
+    if (value > h->max) {
+        return h->max;
+    }
+
+    return value;
+}
+
+double dns_perf_histogram_mean(dns_perf_histogram_t *h)
+{
+    if (h->count == 0) {
+        return 0;
+    }
+
+    return (double) h->sum / h->count;
+}
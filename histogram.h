@@ -0,0 +1,36 @@
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Log-linear histogram (HDR style): values below 2^HISTOGRAM_SUB_BITS are
+ * counted exactly, bigger ones in buckets whose width is 1/64 of their
+ * magnitude, so every value is kept with better than 1% precision in a
+ * fixed amount of memory.  Values are microseconds here.
+ */
+#define HISTOGRAM_SUB_BITS     7
+#define HISTOGRAM_SUB_COUNT    (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_HALF_COUNT   (HISTOGRAM_SUB_COUNT / 2)
+#define HISTOGRAM_MAX_BITS     36          /* ~19 hours in microseconds */
+#define HISTOGRAM_BUCKETS      \
+    (HISTOGRAM_SUB_COUNT + (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS) * HISTOGRAM_HALF_COUNT)
+
+typedef struct dns_perf_histogram_s {
+    uint64_t  count;
+    uint64_t  min;
+    uint64_t  max;
+    uint64_t  sum;
+    uint64_t  buckets[HISTOGRAM_BUCKETS];
+} dns_perf_histogram_t;
+
+void dns_perf_histogram_init(dns_perf_histogram_t *h);
+void dns_perf_histogram_record(dns_perf_histogram_t *h, uint64_t value);
+void dns_perf_histogram_merge(dns_perf_histogram_t *dst, dns_perf_histogram_t *src);
+void dns_perf_histogram_sub(dns_perf_histogram_t *dst, dns_perf_histogram_t *src);
+uint64_t dns_perf_histogram_percentile(dns_perf_histogram_t *h, double percentile);
+double dns_perf_histogram_mean(dns_perf_histogram_t *h);
+void dns_perf_histogram_bucket_range(int index, uint64_t *low, uint64_t *high);
+
+#endif
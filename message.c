@@ -0,0 +1,479 @@
+/*
+ * This file if part of dnsperf.
+ *
+ * Copyright (C) 2014 Cobblau
+ *
+ * dnsperf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dnsperf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Wire format encoding of DNS messages.  Queries are encoded once when
+ * the data file is loaded, the send path only copies them.  Responses
+ * are checked in place, nothing is allocated or copied.
+ */
+
+#include <string.h>
+#include <message.h>
+
+
+/*
+ * dns_perf_name_to_wire:
+ *     encode a presentation format name ("www.example.com", "\\." and
+ *     "\DDD" escapes allowed) into uncompressed wire format.
+ *     Returns the wire length or -1.
+ */
+int dns_perf_name_to_wire(const char *name, u_char *buf, int size)
+{
+    const char *p = name;
+    u_char     *label;
+    int         len = 0, n, c;
+
+    if (p[0] == '.' && p[1] == '\0') {
+        p++;
+    }
+
+    while (*p != '\0') {
+        if (len + 1 >= size) {
+            return -1;
+        }
+
+        label = buf + len++;
+        n = 0;
+
+        while (*p != '\0' && *p != '.') {
+            c = (u_char) *p++;
+
+            if (c == '\\') {
+                if (p[0] >= '0' && p[0] <= '9' && p[1] >= '0' && p[1] <= '9'
+                    && p[2] >= '0' && p[2] <= '9')
+                {
+                    c = (p[0] - '0') * 100 + (p[1] - '0') * 10 + (p[2] - '0');
+                    if (c > 255) {
+                        return -1;
+                    }
+                    p += 3;
+
+                } else if (*p != '\0') {
+                    c = (u_char) *p++;
+
+                } else {
+                    return -1;
+                }
+            }
+
+            if (n == DNS_MAX_LABEL_LEN || len >= size) {
+                return -1;
+            }
+
+            buf[len++] = c;
+            n++;
+        }
+
+        if (n == 0) {
+            return -1;  /* empty label */
+        }
+
+        *label = n;
+
+        if (*p == '.') {
+            p++;
+        }
+    }
+
+    if (len >= size || len + 1 > DNS_MAX_NAME_LEN) {
+        return -1;
+    }
+
+    buf[len++] = 0;   /* root */
+
+    return len;
+}
+
+/*
+ * dns_perf_message_build_query:
+ *     a query with one question and message id 0.
+ *     Returns the message length or -1.
+ */
+int dns_perf_message_build_query(u_char *buf, int size, const char *name,
+                                 int qtype, int qclass, int rd)
+{
+    int  len;
+
+    if (size < DNS_MESSAGE_HEADER_LEN) {
+        return -1;
+    }
+
+    memset(buf, 0, DNS_MESSAGE_HEADER_LEN);
+
+    if (rd) {
+        buf[2] = DNS_HEADER_FLAG_RD >> 8;
+    }
+
+    buf[5] = 1;   /* QDCOUNT */
+
+    len = dns_perf_name_to_wire(name, buf + DNS_MESSAGE_HEADER_LEN,
+                                size - DNS_MESSAGE_HEADER_LEN - 4);
+    if (len == -1) {
+        return -1;
+    }
+
+    len += DNS_MESSAGE_HEADER_LEN;
+
+    buf[len++] = qtype >> 8;
+    buf[len++] = qtype & 0xff;
+    buf[len++] = qclass >> 8;
+    buf[len++] = qclass & 0xff;
+
+    return len;
+}
+
+/*
+ * dns_perf_message_add_opt:
+ *     append an EDNS0 OPT record (RFC 6891) carrying `options' to the
+ *     additional section of the message.  Returns the new length or -1.
+ */
+int dns_perf_message_add_opt(u_char *buf, int len, int size,
+                             unsigned int udp_size, unsigned int flags,
+                             const u_char *options, int options_len)
+{
+    u_char  *p;
+    int      arcount;
+
+    if (len + DNS_OPT_RR_LEN + options_len > size) {
+        return -1;
+    }
+
+    arcount = (buf[10] << 8 | buf[11]) + 1;
+    buf[10] = arcount >> 8;
+    buf[11] = arcount & 0xff;
+
+    p = buf + len;
+
+    *p++ = 0;                       /* root name */
+
+    *p++ = DNS_RR_OPT >> 8;         /* type OPT */
+    *p++ = DNS_RR_OPT & 0xff;
+
+    *p++ = udp_size >> 8;           /* requestor's UDP payload size */
+    *p++ = udp_size & 0xff;
+
+    *p++ = 0;                       /* extended RCODE */
+    *p++ = 0;                       /* version */
+    *p++ = flags >> 8;              /* DO and Z flags */
+    *p++ = flags & 0xff;
+
+    *p++ = options_len >> 8;        /* RDLEN */
+    *p++ = options_len & 0xff;
+
+    if (options_len > 0) {
+        memcpy(p, options, options_len);
+    }
+
+    return len + DNS_OPT_RR_LEN + options_len;
+}
+
+/*
+ * dns_perf_message_option:
+ *     encode an EDNS0 option, `data' NULL for `data_len' zero bytes as
+ *     padding (RFC 7830) is made of.  Returns the option length or -1.
+ */
+int dns_perf_message_option(u_char *buf, int size, int code,
+                            const u_char *data, int data_len)
+{
+    if (data_len > 0xffff || DNS_OPTION_LEN(data_len) > size) {
+        return -1;
+    }
+
+    buf[0] = code >> 8;                         /* option code */
+    buf[1] = code & 0xff;
+
+    buf[2] = data_len >> 8;                     /* option length */
+    buf[3] = data_len & 0xff;
+
+    if (data != NULL) {
+        memcpy(buf + 4, data, data_len);
+    } else {
+        memset(buf + 4, 0, data_len);
+    }
+
+    return DNS_OPTION_LEN(data_len);
+}
+
+/*
+ * dns_perf_message_ecs_option:
+ *     encode an edns-client-subnet option (RFC 7871), only the significant
+ *     bytes of `addr' are sent.  Returns the option length or -1.
+ */
+int dns_perf_message_ecs_option(u_char *buf, int size, int family,
+                                int source_prefix, const u_char *addr)
+{
+    u_char  *p = buf;
+    int      n, i;
+
+    n = (source_prefix + 7) / 8;
+
+    if (DNS_ECS_OPTION_LEN(n) > size) {
+        return -1;
+    }
+
+    *p++ = DNS_OPTTYPE_CLIENT_SUBNET >> 8;      /* option code */
+    *p++ = DNS_OPTTYPE_CLIENT_SUBNET & 0xff;
+
+    *p++ = (4 + n) >> 8;                        /* option length */
+    *p++ = (4 + n) & 0xff;
+
+    *p++ = family >> 8;                         /* 1: IPv4, 2: IPv6 */
+    *p++ = family & 0xff;
+
+    *p++ = source_prefix;                       /* source netmask */
+    *p++ = 0;                                   /* scope netmask */
+
+    for (i = 0; i < n; i++) {
+        *p++ = addr[i];
+    }
+
+    /* clear the bits beyond the source prefix */
+    if (source_prefix % 8) {
+        p[-1] &= 0xff << (8 - source_prefix % 8);
+    }
+
+    return DNS_ECS_OPTION_LEN(n);
+}
+
+/*
+ * dns_perf_message_skip_name:
+ *     offset just past the name at `off', -1 if it runs out of the
+ *     message.  A compression pointer ends the name.
+ */
+static int dns_perf_message_skip_name(const u_char *buf, int len, int off)
+{
+    int  n;
+
+    while (off < len) {
+        n = buf[off];
+
+        if (n == 0) {
+            return off + 1;
+        }
+
+        if ((n & DNS_NAME_COMPRESS_POINTER) == DNS_NAME_COMPRESS_POINTER) {
+            return off + 2 <= len ? off + 2 : -1;
+        }
+
+        if (n & DNS_NAME_COMPRESS_POINTER) {
+            return -1;  /* obsolete extended label types */
+        }
+
+        off += n + 1;
+    }
+
+    return -1;
+}
+
+/*
+ * dns_perf_message_parse_response:
+ *     check that `buf' is a response to a standard query whose sections
+ *     hold what the header counts, and fill `r' from its header.
+ *     A truncated response may end anywhere after the question.
+ *     Returns DNS_RESPONSE_OK or DNS_RESPONSE_MALFORMED.
+ */
+int dns_perf_message_parse_response(const u_char *buf, int len,
+                                    dns_perf_response_t *r)
+{
+    unsigned int  qdcount, count, rdlen;
+    int           off;
+
+    if (len < DNS_MESSAGE_HEADER_LEN) {
+        return DNS_RESPONSE_MALFORMED;
+    }
+
+    r->id = buf[0] << 8 | buf[1];
+    r->flags = buf[2] << 8 | buf[3];
+    r->ancount = buf[6] << 8 | buf[7];
+
+    if (!(r->flags & DNS_HEADER_FLAG_QR)
+        || (r->flags & DNS_HEADER_OPCODE_MASK) != DNS_OPCODE_QUERY << 11)
+    {
+        return DNS_RESPONSE_MALFORMED;
+    }
+
+    qdcount = buf[4] << 8 | buf[5];
+    off = DNS_MESSAGE_HEADER_LEN;
+
+    for ( ; qdcount > 0; qdcount--) {
+        off = dns_perf_message_skip_name(buf, len, off);
+        if (off == -1 || off + 4 > len) {
+            return DNS_RESPONSE_MALFORMED;
+        }
+
+        off += 4;
+    }
+
+    if (r->flags & DNS_HEADER_FLAG_TC) {
+        return DNS_RESPONSE_OK;
+    }
+
+    count = r->ancount + (buf[8] << 8 | buf[9]) + (buf[10] << 8 | buf[11]);
+
+    for ( ; count > 0; count--) {
+        off = dns_perf_message_skip_name(buf, len, off);
+        if (off == -1 || off + 10 > len) {
+            return DNS_RESPONSE_MALFORMED;
+        }
+
+        rdlen = buf[off + 8] << 8 | buf[off + 9];
+        off += 10 + rdlen;
+
+        if (off > len) {
+            return DNS_RESPONSE_MALFORMED;
+        }
+    }
+
+    return DNS_RESPONSE_OK;
+}
+
+/*
+ * dns_perf_message_parse_query:
+ *     check that `buf' is a standard query with one question whose name is
+ *     not compressed, as dnsperf sends them, and write the name in text
+ *     form without the final dot to `name'.  Returns the length of the
+ *     name, or -1.
+ */
+int dns_perf_message_parse_query(const u_char *buf, int len, char *name,
+                                 int size, int *qtype)
+{
+    unsigned int  flags;
+    int           off, n, name_len;
+
+    if (len < DNS_MESSAGE_HEADER_LEN) {
+        return -1;
+    }
+
+    flags = buf[2] << 8 | buf[3];
+
+    if ((flags & DNS_HEADER_FLAG_QR)
+        || (flags & DNS_HEADER_OPCODE_MASK) != DNS_OPCODE_QUERY << 11
+        || (buf[4] << 8 | buf[5]) != 1)
+    {
+        return -1;
+    }
+
+    off = DNS_MESSAGE_HEADER_LEN;
+    name_len = 0;
+
+    while (off < len && (n = buf[off]) != 0) {
+        if ((n & DNS_NAME_COMPRESS_POINTER) != 0
+            || off + 1 + n > len || name_len + n + 1 > size)
+        {
+            return -1;
+        }
+
+        if (name_len != 0) {
+            name[name_len++] = '.';
+        }
+
+        memcpy(name + name_len, buf + off + 1, n);
+        name_len += n;
+        off += n + 1;
+    }
+
+    if (off + 5 > len) {
+        return -1;
+    }
+
+    *qtype = buf[off + 1] << 8 | buf[off + 2];
+
+    return name_len;
+}
+
+#define dns_perf_lower(c)  ((c) >= 'A' && (c) <= 'Z' ? (c) + 32 : (c))
+
+/*
+ * dns_perf_message_check_question:
+ *     compare the question of the response `buf', which has passed
+ *     dns_perf_message_parse_response(), with the one of `query'.  Names
+ *     are compared ignoring case, compression is followed in the response.
+ *     Returns DNS_RESPONSE_OK, DNS_RESPONSE_MISMATCH or
+ *     DNS_RESPONSE_MALFORMED.
+ */
+int dns_perf_message_check_question(const u_char *buf, int len,
+                                    const u_char *query)
+{
+    const u_char  *q = query + DNS_MESSAGE_HEADER_LEN;
+    int            off, end, n, i, jumps = 0;
+
+    if ((buf[4] << 8 | buf[5]) != 1) {
+        return DNS_RESPONSE_MISMATCH;
+    }
+
+    off = DNS_MESSAGE_HEADER_LEN;
+    end = -1;   /* where the question goes on after a pointer */
+
+    for (;;) {
+        n = buf[off];
+
+        if ((n & DNS_NAME_COMPRESS_POINTER) == DNS_NAME_COMPRESS_POINTER) {
+            if (off + 1 >= len) {
+                return DNS_RESPONSE_MALFORMED;
+            }
+
+            if (end == -1) {
+                end = off + 2;
+            }
+
+            off = (n & 0x3f) << 8 | buf[off + 1];
+
+            /* a loop, or a pointer out of the message */
+            if (++jumps > DNS_MAX_NAME_LEN / 2 || off >= len) {
+                return DNS_RESPONSE_MALFORMED;
+            }
+
+            continue;
+        }
+
+        if (n != *q) {
+            return DNS_RESPONSE_MISMATCH;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        if (off + 1 + n > len) {
+            return DNS_RESPONSE_MALFORMED;
+        }
+
+        for (i = 1; i <= n; i++) {
+            if (dns_perf_lower(buf[off + i]) != dns_perf_lower(q[i])) {
+                return DNS_RESPONSE_MISMATCH;
+            }
+        }
+
+        off += n + 1;
+        q += n + 1;
+
+        if (off >= len) {
+            return DNS_RESPONSE_MALFORMED;
+        }
+    }
+
+    off = (end == -1) ? off + 1 : end;
+
+    /* type and class, parse_response made sure they are there */
+    if (memcmp(buf + off, q + 1, 4) != 0) {
+        return DNS_RESPONSE_MISMATCH;
+    }
+
+    return DNS_RESPONSE_OK;
+}
@@ -0,0 +1,42 @@
+#ifndef _MESSAGE_H
+#define _MESSAGE_H
+
+#include <sys/types.h>
+#include <dns_param.h>
+
+#define DNS_OPT_RR_LEN          11      /* OPT RR without its options */
+#define DNS_ECS_OPTION_LEN(n)   (8 + (n))   /* n: address bytes */
+#define DNS_OPTION_LEN(n)       (4 + (n))   /* n: option data bytes */
+
+/*
+ * verdicts of dns_perf_message_parse_response() and
+ * dns_perf_message_check_question()
+ */
+#define DNS_RESPONSE_OK         0
+#define DNS_RESPONSE_MALFORMED  1   /* not a well formed response message */
+#define DNS_RESPONSE_MISMATCH   2   /* the question is not the one asked */
+
+typedef struct dns_perf_response_s {
+    unsigned short  id;
+    unsigned short  flags;
+    unsigned short  ancount;
+} dns_perf_response_t;
+
+int dns_perf_name_to_wire(const char *name, u_char *buf, int size);
+int dns_perf_message_build_query(u_char *buf, int size, const char *name,
+                                 int qtype, int qclass, int rd);
+int dns_perf_message_add_opt(u_char *buf, int len, int size,
+                             unsigned int udp_size, unsigned int flags,
+                             const u_char *options, int options_len);
+int dns_perf_message_option(u_char *buf, int size, int code,
+                            const u_char *data, int data_len);
+int dns_perf_message_ecs_option(u_char *buf, int size, int family,
+                                int source_prefix, const u_char *addr);
+int dns_perf_message_parse_response(const u_char *buf, int len,
+                                    dns_perf_response_t *r);
+int dns_perf_message_parse_query(const u_char *buf, int len, char *name,
+                                 int size, int *qtype);
+int dns_perf_message_check_question(const u_char *buf, int len,
+                                    const u_char *query);
+
+#endif
@@ -0,0 +1,613 @@
+/*
+ * This file if part of dnsperf.
+ *
+ * Copyright (C) 2014 Cobblau
+ *
+ * dnsperf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dnsperf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reading of pcap and pcapng capture files, without libpcap.  The file
+ * is walked in memory and the payload of every UDP datagram over IPv4 or
+ * IPv6 is handed to the caller with its timestamp.  DNS messages are
+ * written back as UDP datagrams of a raw IP pcapng file.
+ */
+
+#include <string.h>
+#include <sys/socket.h>
+#include <pcapfile.h>
+
+
+#define PCAP_MAGIC_USEC     0xa1b2c3d4
+#define PCAP_MAGIC_NSEC     0xa1b23c4d
+#define PCAP_HEADER_LEN     24
+#define PCAP_RECORD_LEN     16
+
+#define PCAPNG_SHB          0x0a0d0d0a   /* section header block */
+#define PCAPNG_IDB          1            /* interface description block */
+#define PCAPNG_OPB          2            /* obsolete packet block */
+#define PCAPNG_SPB          3            /* simple packet block */
+#define PCAPNG_EPB          6            /* enhanced packet block */
+#define PCAPNG_BYTE_ORDER   0x1a2b3c4d
+#define PCAPNG_IF_TSRESOL   9
+
+#define PCAP_MAX_IF         64
+
+/* link types */
+#define LINKTYPE_NULL       0
+#define LINKTYPE_ETHERNET   1
+#define LINKTYPE_RAW        101
+#define LINKTYPE_LOOP       108
+#define LINKTYPE_LINUX_SLL  113
+#define LINKTYPE_IPV4       228
+#define LINKTYPE_IPV6       229
+#define LINKTYPE_LINUX_SLL2 276
+
+typedef struct dns_perf_pcap_if_s {
+    unsigned int  linktype;
+    uint64_t      units;      /* timestamp units per second */
+} dns_perf_pcap_if_t;
+
+typedef struct dns_perf_pcap_s {
+    const u_char         *buf;
+    size_t                len;
+    int                   swap;      /* the file is of the other byte order */
+
+    dns_perf_pcap_if_t    ifs[PCAP_MAX_IF];
+    unsigned int          if_number;
+
+    uint64_t              time;      /* of the last packet, usec */
+
+    dns_perf_pcap_handler_f  handler;
+    void                 *data;
+} dns_perf_pcap_t;
+
+
+static uint32_t dns_perf_pcap_u32(dns_perf_pcap_t *p, const u_char *b)
+{
+    uint32_t  v;
+
+    memcpy(&v, b, 4);
+
+    return p->swap ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t dns_perf_pcap_u16(dns_perf_pcap_t *p, const u_char *b)
+{
+    uint16_t  v;
+
+    memcpy(&v, b, 2);
+
+    return p->swap ? __builtin_bswap16(v) : v;
+}
+
+
+/*
+ * dns_perf_pcap_check:
+ *     1 when `buf' starts like a pcap or pcapng file, 0 otherwise.
+ */
+int dns_perf_pcap_check(const u_char *buf, size_t len)
+{
+    uint32_t  magic;
+
+    if (len < 12) {
+        return 0;
+    }
+
+    memcpy(&magic, buf, 4);
+
+    if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC
+        || __builtin_bswap32(magic) == PCAP_MAGIC_USEC
+        || __builtin_bswap32(magic) == PCAP_MAGIC_NSEC)
+    {
+        return 1;
+    }
+
+    return magic == PCAPNG_SHB;
+}
+
+
+/*
+ * dns_perf_pcap_packet:
+ *     find the UDP payload of a packet of `linktype', complete datagrams
+ *     only.  Fragments, truncated packets and anything else are ignored.
+ */
+static int dns_perf_pcap_packet(dns_perf_pcap_t *p, unsigned int linktype,
+    const u_char *pkt, unsigned int len)
+{
+    const u_char  *ip, *end;
+    unsigned int   off, type, n, next;
+
+    end = pkt + len;
+
+    switch (linktype) {
+    case LINKTYPE_NULL:
+    case LINKTYPE_LOOP:
+        off = 4;
+        type = 0;
+        break;
+
+    case LINKTYPE_ETHERNET:
+        for (off = 12; ; off += 4) {
+            if (off + 2 > len) {
+                return 0;
+            }
+
+            type = pkt[off] << 8 | pkt[off + 1];
+
+            /* 802.1Q and 802.1ad tags */
+            if (type != 0x8100 && type != 0x88a8 && type != 0x9100) {
+                break;
+            }
+        }
+        off += 2;
+        break;
+
+    case LINKTYPE_LINUX_SLL:
+        if (len < 16) {
+            return 0;
+        }
+        type = pkt[14] << 8 | pkt[15];
+        off = 16;
+        break;
+
+    case LINKTYPE_LINUX_SLL2:
+        if (len < 20) {
+            return 0;
+        }
+        type = pkt[0] << 8 | pkt[1];
+        off = 20;
+        break;
+
+    case LINKTYPE_RAW:
+    case LINKTYPE_IPV4:
+    case LINKTYPE_IPV6:
+        off = 0;
+        type = 0;
+        break;
+
+    default:
+        return 0;
+    }
+
+    if (off >= len) {
+        return 0;
+    }
+
+    ip = pkt + off;
+
+    /* the link layers without an ethertype are told by the IP version */
+    if (type == 0) {
+        type = (ip[0] >> 4) == 4 ? 0x0800 : (ip[0] >> 4) == 6 ? 0x86dd : 0;
+    }
+
+    if (type == 0x0800) {
+        if (end - ip < 20 || (ip[0] >> 4) != 4 || ip[9] != 17) {
+            return 0;
+        }
+
+        /* more fragments, or not the first one */
+        if ((ip[6] << 8 | ip[7]) & 0x3fff) {
+            return 0;
+        }
+
+        n = ip[2] << 8 | ip[3];
+        if (n < 20 || ip + n > end) {
+            return 0;
+        }
+
+        end = ip + n;
+        ip += (ip[0] & 0x0f) * 4;
+
+    } else if (type == 0x86dd) {
+        if (end - ip < 40 || (ip[0] >> 4) != 6) {
+            return 0;
+        }
+
+        n = ip[4] << 8 | ip[5];
+        if (ip + 40 + n > end) {
+            return 0;
+        }
+
+        end = ip + 40 + n;
+        next = ip[6];
+        ip += 40;
+
+        /* hop-by-hop, routing and destination options, fragments are left */
+        while (next == 0 || next == 43 || next == 60) {
+            if (end - ip < 8) {
+                return 0;
+            }
+
+            next = ip[0];
+            ip += (ip[1] + 1) * 8;
+        }
+
+        if (next != 17) {
+            return 0;
+        }
+
+    } else {
+        return 0;
+    }
+
+    if (end - ip < 8) {
+        return 0;
+    }
+
+    n = ip[4] << 8 | ip[5];
+    if (n < 8 || ip + n > end) {
+        return 0;
+    }
+
+    return p->handler(p->data, p->time, ip + 8, n - 8);
+}
+
+
+static int dns_perf_pcap_walk_pcap(dns_perf_pcap_t *p)
+{
+    const u_char  *b;
+    size_t         off;
+    uint32_t       magic, caplen;
+    uint64_t       units;
+    unsigned int   linktype;
+
+    b = p->buf;
+
+    if (p->len < PCAP_HEADER_LEN) {
+        return -1;
+    }
+
+    memcpy(&magic, b, 4);
+    p->swap = (magic != PCAP_MAGIC_USEC && magic != PCAP_MAGIC_NSEC);
+    magic = dns_perf_pcap_u32(p, b);
+
+    units = (magic == PCAP_MAGIC_NSEC) ? 1000000000 : 1000000;
+    linktype = dns_perf_pcap_u32(p, b + 20) & 0xffff;
+
+    for (off = PCAP_HEADER_LEN; off + PCAP_RECORD_LEN <= p->len; ) {
+        b = p->buf + off;
+        caplen = dns_perf_pcap_u32(p, b + 8);
+
+        if (caplen > p->len - off - PCAP_RECORD_LEN) {
+            return -1;
+        }
+
+        p->time = (uint64_t) dns_perf_pcap_u32(p, b) * 1000000
+                  + (uint64_t) dns_perf_pcap_u32(p, b + 4) * 1000000 / units;
+
+        if (dns_perf_pcap_packet(p, linktype, b + PCAP_RECORD_LEN, caplen)
+            == -1)
+        {
+            return -1;
+        }
+
+        off += PCAP_RECORD_LEN + caplen;
+    }
+
+    return 0;
+}
+
+
+/*
+ * dns_perf_pcapng_idb:
+ *     keep the link type and the timestamp resolution of an interface.
+ */
+static int dns_perf_pcapng_idb(dns_perf_pcap_t *p, const u_char *b,
+    uint32_t len)
+{
+    dns_perf_pcap_if_t  *ifp;
+    uint32_t             off, code, n, i;
+
+    if (p->if_number == PCAP_MAX_IF || len < 20) {
+        return -1;
+    }
+
+    ifp = &p->ifs[p->if_number++];
+    ifp->linktype = dns_perf_pcap_u16(p, b + 8);
+    ifp->units = 1000000;
+
+    for (off = 16; off + 4 <= len - 4; off += 4 + ((n + 3) & ~3)) {
+        code = dns_perf_pcap_u16(p, b + off);
+        n = dns_perf_pcap_u16(p, b + off + 2);
+
+        if (code == 0) {
+            break;
+        }
+
+        if (code == PCAPNG_IF_TSRESOL && n >= 1) {
+            /* 10^-v, or 2^-v when the top bit is set */
+            if (b[off + 4] & 0x80) {
+                ifp->units = (b[off + 4] & 0x7f) < 63
+                             ? 1ULL << (b[off + 4] & 0x7f) : 0;
+            } else {
+                for (ifp->units = 1, i = 0; i < b[off + 4] && i < 19; i++) {
+                    ifp->units *= 10;
+                }
+            }
+
+            if (ifp->units == 0) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int dns_perf_pcap_walk_pcapng(dns_perf_pcap_t *p)
+{
+    const u_char        *b;
+    size_t               off;
+    uint32_t             type, len, magic, caplen, id;
+    uint64_t             ts;
+    dns_perf_pcap_if_t  *ifp;
+
+    for (off = 0; off + 12 <= p->len; off += len) {
+        b = p->buf + off;
+
+        memcpy(&type, b, 4);
+
+        if (type == PCAPNG_SHB) {
+            memcpy(&magic, b + 8, 4);
+            p->swap = (magic != PCAPNG_BYTE_ORDER);
+
+            if (dns_perf_pcap_u32(p, b + 8) != PCAPNG_BYTE_ORDER) {
+                return -1;
+            }
+
+            /* interfaces are numbered anew in every section */
+            p->if_number = 0;
+        }
+
+        type = dns_perf_pcap_u32(p, b);
+        len = dns_perf_pcap_u32(p, b + 4);
+
+        if (len < 12 || len % 4 != 0 || len > p->len - off) {
+            return -1;
+        }
+
+        switch (type) {
+        case PCAPNG_IDB:
+            if (dns_perf_pcapng_idb(p, b, len) == -1) {
+                return -1;
+            }
+            break;
+
+        case PCAPNG_EPB:
+        case PCAPNG_OPB:
+            if (len < 32) {
+                return -1;
+            }
+
+            if (type == PCAPNG_EPB) {
+                id = dns_perf_pcap_u32(p, b + 8);
+            } else {
+                id = dns_perf_pcap_u16(p, b + 8);
+            }
+
+            caplen = dns_perf_pcap_u32(p, b + 20);
+
+            if (id >= p->if_number || caplen > len - 32) {
+                return -1;
+            }
+
+            ifp = &p->ifs[id];
+            ts = (uint64_t) dns_perf_pcap_u32(p, b + 12) << 32
+                 | dns_perf_pcap_u32(p, b + 16);
+
+            p->time = ts / ifp->units * 1000000
+                      + (uint64_t) ((double) (ts % ifp->units) * 1000000
+                                    / ifp->units);
+
+            if (dns_perf_pcap_packet(p, ifp->linktype, b + 28, caplen) == -1) {
+                return -1;
+            }
+            break;
+
+        case PCAPNG_SPB:
+            /* no timestamp, it is taken as sent with the packet before */
+            if (len < 16 || p->if_number == 0) {
+                return -1;
+            }
+
+            caplen = dns_perf_pcap_u32(p, b + 8);
+            if (caplen > len - 16) {
+                caplen = len - 16;
+            }
+
+            if (dns_perf_pcap_packet(p, p->ifs[0].linktype, b + 12, caplen)
+                == -1)
+            {
+                return -1;
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * dns_perf_pcap_walk:
+ *     call `handler' with the payload of every UDP datagram of the capture
+ *     in `buf', in file order.  Returns -1 when the file is broken or the
+ *     handler fails.
+ */
+int dns_perf_pcap_walk(const u_char *buf, size_t len,
+    dns_perf_pcap_handler_f handler, void *data)
+{
+    dns_perf_pcap_t  p;
+    uint32_t         magic;
+
+    memset(&p, 0, sizeof(dns_perf_pcap_t));
+    p.buf = buf;
+    p.len = len;
+    p.handler = handler;
+    p.data = data;
+
+    memcpy(&magic, buf, 4);
+
+    if (magic == PCAPNG_SHB) {
+        return dns_perf_pcap_walk_pcapng(&p);
+    }
+
+    return dns_perf_pcap_walk_pcap(&p);
+}
+
+
+/*
+ * dns_perf_pcap_write_header:
+ *     start a pcapng file of one raw IP interface.
+ */
+int dns_perf_pcap_write_header(FILE *f, unsigned int snaplen)
+{
+    uint32_t  shb[7], idb[5];
+    uint16_t  version[2] = { 1, 0 };              /* major, minor */
+    uint16_t  linktype[2] = { LINKTYPE_RAW, 0 };  /* and 16 reserved bits */
+
+    shb[0] = PCAPNG_SHB;
+    shb[1] = sizeof(shb);
+    shb[2] = PCAPNG_BYTE_ORDER;
+    memcpy(&shb[3], version, sizeof(version));
+    shb[4] = 0xffffffff;        /* section length not known */
+    shb[5] = 0xffffffff;
+    shb[6] = sizeof(shb);
+
+    idb[0] = PCAPNG_IDB;
+    idb[1] = sizeof(idb);
+    memcpy(&idb[2], linktype, sizeof(linktype));
+    idb[3] = snaplen;
+    idb[4] = sizeof(idb);
+
+    if (fwrite(shb, sizeof(shb), 1, f) != 1
+        || fwrite(idb, sizeof(idb), 1, f) != 1)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static uint32_t dns_perf_pcap_sum(uint32_t sum, const u_char *b, int len)
+{
+    int  i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += b[i] << 8 | b[i + 1];
+    }
+
+    if (len & 1) {
+        sum += b[len - 1] << 8;
+    }
+
+    return sum;
+}
+
+static uint16_t dns_perf_pcap_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return ~sum & 0xffff;
+}
+
+
+/*
+ * dns_perf_pcap_write_udp:
+ *     write an enhanced packet block of the DNS message `payload' in a UDP
+ *     datagram from `src' to `dst'.  `caplen' bytes of its `len' were kept.
+ *     `time' is in usec since the epoch.
+ */
+int dns_perf_pcap_write_udp(FILE *f, uint64_t time, dns_perf_pcap_udp_t *u,
+    const u_char *payload, int caplen, int len)
+{
+    u_char    hdr[48], *udp;
+    uint32_t  epb[7], sum;
+    int       hlen, pad;
+
+    memset(hdr, 0, sizeof(hdr));
+
+    if (u->family == AF_INET6) {
+        hlen = 48;
+        hdr[0] = 0x60;
+        hdr[4] = (8 + len) >> 8;
+        hdr[5] = (8 + len) & 0xff;
+        hdr[6] = 17;
+        hdr[7] = 64;
+        memcpy(hdr + 8, u->src, 16);
+        memcpy(hdr + 24, u->dst, 16);
+
+    } else {
+        hlen = 28;
+        hdr[0] = 0x45;
+        hdr[2] = (28 + len) >> 8;
+        hdr[3] = (28 + len) & 0xff;
+        hdr[8] = 64;
+        hdr[9] = 17;
+        memcpy(hdr + 12, u->src, 4);
+        memcpy(hdr + 16, u->dst, 4);
+
+        sum = dns_perf_pcap_fold(dns_perf_pcap_sum(0, hdr, 20));
+        hdr[10] = sum >> 8;
+        hdr[11] = sum & 0xff;
+    }
+
+    udp = hdr + hlen - 8;
+    udp[0] = u->sport >> 8;
+    udp[1] = u->sport & 0xff;
+    udp[2] = u->dport >> 8;
+    udp[3] = u->dport & 0xff;
+    udp[4] = (8 + len) >> 8;
+    udp[5] = (8 + len) & 0xff;
+
+    /* mandatory over IPv6, it can only be computed on the whole payload */
+    if (u->family == AF_INET6 && caplen == len) {
+        sum = dns_perf_pcap_sum(0, hdr + 8, 32);
+        sum += 17 + 8 + len;
+        sum = dns_perf_pcap_sum(sum, udp, 8);
+        sum = dns_perf_pcap_fold(dns_perf_pcap_sum(sum, payload, len));
+        sum = sum ? sum : 0xffff;
+
+        udp[6] = sum >> 8;
+        udp[7] = sum & 0xff;
+    }
+
+    pad = (4 - (hlen + caplen) % 4) % 4;
+
+    epb[0] = PCAPNG_EPB;
+    epb[1] = 32 + hlen + caplen + pad;
+    epb[2] = 0;                 /* interface */
+    epb[3] = time >> 32;
+    epb[4] = time & 0xffffffff;
+    epb[5] = hlen + caplen;
+    epb[6] = hlen + len;
+
+    if (fwrite(epb, sizeof(epb), 1, f) != 1
+        || fwrite(hdr, hlen, 1, f) != 1
+        || (caplen && fwrite(payload, caplen, 1, f) != 1)
+        || fwrite("\0\0\0", 1, pad, f) != pad
+        || fwrite(&epb[1], 4, 1, f) != 1)
+    {
+        return -1;
+    }
+
+    return 0;
+}
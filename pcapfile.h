@@ -0,0 +1,32 @@
+#ifndef _PCAPFILE_H
+#define _PCAPFILE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * called with the timestamp in usec and the UDP payload of every datagram,
+ * returns 0 to go on and -1 to stop the walk.
+ */
+typedef int (*dns_perf_pcap_handler_f)(void *data, uint64_t time,
+    const u_char *payload, int len);
+
+/* a UDP datagram written, addresses in network order, ports in host order */
+typedef struct dns_perf_pcap_udp_s {
+    int             family;
+    u_char          src[16];
+    u_char          dst[16];
+    unsigned short  sport;
+    unsigned short  dport;
+} dns_perf_pcap_udp_t;
+
+int dns_perf_pcap_check(const u_char *buf, size_t len);
+int dns_perf_pcap_walk(const u_char *buf, size_t len,
+    dns_perf_pcap_handler_f handler, void *data);
+int dns_perf_pcap_write_header(FILE *f, unsigned int snaplen);
+int dns_perf_pcap_write_udp(FILE *f, uint64_t time, dns_perf_pcap_udp_t *u,
+    const u_char *payload, int caplen, int len);
+
+#endif
@@ -20,28 +20,182 @@
 
 #include <sock.h>
 
-int dns_perf_open_udp_socket(char *host, unsigned int port, int family)
+/*
+ * dns_perf_resolve_addr:
+ *     the socket address of `host', an IPv4 or IPv6 address or a name,
+ *     of the given family or either if it is AF_UNSPEC.
+ */
+int dns_perf_resolve_addr(const char *host, unsigned int port, int family,
+    dns_perf_addr_t *addr)
+{
+    struct addrinfo  hints, *res;
+    char             service[8];
+    int              ret;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICSERV;
+
+    snprintf(service, sizeof(service), "%u", port);
+
+    if ((ret = getaddrinfo(host, service, &hints, &res)) != 0) {
+        fprintf(stderr, "Error resolve address %s: %s\n", host,
+                gai_strerror(ret));
+        return -1;
+    }
+
+    memcpy(&addr->ss, res->ai_addr, res->ai_addrlen);
+    addr->len = res->ai_addrlen;
+
+    freeaddrinfo(res);
+
+    return 0;
+}
+
+/*
+ * dns_perf_parse_source:
+ *     a source address of -a, "addr[/prefix]", IPv4 or IPv6.  A range
+ *     is the whole CIDR block, `addr' need not be its first address.
+ */
+int dns_perf_parse_source(const char *s, dns_perf_source_t *src)
+{
+    char          buf[INET6_ADDRSTRLEN + 8], *p, *end;
+    unsigned int  bits, i;
+    long          prefix;
+
+    if (strlen(s) >= sizeof(buf)) {
+        return -1;
+    }
+
+    strcpy(buf, s);
+
+    if ((p = strchr(buf, '/')) != NULL) {
+        *p++ = '\0';
+    }
+
+    memset(src, 0, sizeof(dns_perf_source_t));
+
+    if (inet_pton(AF_INET, buf, src->addr) == 1) {
+        src->family = AF_INET;
+        bits = 32;
+    } else if (inet_pton(AF_INET6, buf, src->addr) == 1) {
+        src->family = AF_INET6;
+        bits = 128;
+    } else {
+        return -1;
+    }
+
+    prefix = bits;
+
+    if (p != NULL) {
+        prefix = strtol(p, &end, 10);
+        if (*p == '\0' || *end != '\0' || prefix < 0 || prefix > bits) {
+            return -1;
+        }
+    }
+
+    for (i = prefix; i < bits; i++) {
+        src->addr[i / 8] &= ~(0x80 >> (i % 8));
+    }
+
+    src->prefix = prefix;
+    src->count = (bits - prefix >= 32) ? (1ULL << 32) : (1ULL << (bits - prefix));
+
+    return 0;
+}
+
+/*
+ * dns_perf_source_addr:
+ *     the socket address of the `n'th address of `src', n < src->count.
+ */
+void dns_perf_source_addr(dns_perf_source_t *src, uint64_t n,
+    unsigned int port, dns_perf_addr_t *addr)
+{
+    struct sockaddr_in   *sin;
+    struct sockaddr_in6  *sin6;
+    unsigned char         a[16];
+    unsigned int          sum;
+    int                   i, len;
+
+    len = (src->family == AF_INET) ? 4 : 16;
+    memcpy(a, src->addr, len);
+
+    /* the host bits are clear, adding never carries into the prefix */
+    for (i = len - 1; i >= 0 && n != 0; i--) {
+        sum = a[i] + (n & 0xff);
+        a[i] = sum;
+        n = (n >> 8) + (sum >> 8);
+    }
+
+    memset(addr, 0, sizeof(dns_perf_addr_t));
+
+    if (src->family == AF_INET) {
+        sin = (struct sockaddr_in *) &addr->ss;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        memcpy(&sin->sin_addr, a, 4);
+        addr->len = sizeof(struct sockaddr_in);
+
+    } else {
+        sin6 = (struct sockaddr_in6 *) &addr->ss;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        memcpy(&sin6->sin6_addr, a, 16);
+        addr->len = sizeof(struct sockaddr_in6);
+    }
+}
+
+/*
+ * dns_perf_bind_socket:
+ *     bind `fd' to the source address `local'.  A busy address is not
+ *     reported, the caller tries another one.
+ */
+static int dns_perf_bind_socket(int fd, dns_perf_addr_t *local)
+{
+    int  val = 1;
+
+    /* addresses routed to this host need not be on an interface */
+#ifdef IP_FREEBIND
+    setsockopt(fd, IPPROTO_IP, IP_FREEBIND, (char *) &val, sizeof(val));
+#endif
+
+    if (bind(fd, (struct sockaddr *) &local->ss, local->len) != 0) {
+        if (errno != EADDRINUSE && errno != EADDRNOTAVAIL) {
+            fprintf(stderr, "Error bind socket: %s\n", strerror(errno));
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int dns_perf_open_udp_socket(dns_perf_addr_t *addr, dns_perf_addr_t *local,
+    int bufsize)
 {
     int fd;
-    struct sockaddr_in  addr;
-    int bufsize, val;
+    int val, err;
 
-    if ((fd = socket(family, SOCK_DGRAM, 0)) == -1) {
-        fprintf(stderr, "Error create udp socket\n");
+    if ((fd = socket(addr->ss.ss_family, SOCK_DGRAM, 0)) == -1) {
         return -1;
     }
 
-    memset((void *)&addr, 0, sizeof(addr));
-    addr.sin_family = family;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = inet_addr(host);
+    if (local != NULL && dns_perf_bind_socket(fd, local) == -1) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
 
-    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
-        fprintf(stderr, "Error connect udp socket\n");
+    if (connect(fd, (struct sockaddr *) &addr->ss, addr->len) != 0) {
+        err = errno;
+        close(fd);
+        errno = err;
         return -1;
     }
 
-    bufsize = 1024 * DEFAULT_BUF_SIZE;
+    bufsize *= 1024;
 
     if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (char *) &bufsize,
                    sizeof(bufsize)) < 0 )
@@ -62,21 +216,27 @@ int dns_perf_open_udp_socket(char *host, unsigned int port, int family)
 }
 
 
-int dns_perf_open_tcp_socket(char *host, unsigned int port, int family)
+int dns_perf_open_tcp_socket(dns_perf_addr_t *addr, dns_perf_addr_t *local)
 {
     int fd;
-    struct sockaddr_in  addr;
-    int bufsize, val;
+    int bufsize, val, err;
 
-    if ((fd = socket(family, SOCK_STREAM, 0)) == -1) {
-        fprintf(stderr, "Error create tcp socket\n");
+    if ((fd = socket(addr->ss.ss_family, SOCK_STREAM, 0)) == -1) {
         return -1;
     }
 
-    memset((void *)&addr, 0, sizeof(addr));
-    addr.sin_family = family;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = inet_addr(host);
+    if (local != NULL) {
+        /* a source port may still be in TIME_WAIT from the last run */
+        val = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *) &val, sizeof(val));
+
+        if (dns_perf_bind_socket(fd, local) == -1) {
+            err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+    }
 
     bufsize = 1024 * DEFAULT_BUF_SIZE;
 
@@ -92,12 +252,38 @@ int dns_perf_open_tcp_socket(char *host, unsigned int port, int family)
         fprintf(stderr, "Warning:  setsockbuf(SO_SNDBUF) failed\n");
     }
 
+    /* queries are small, don't let them wait for each other */
+    val = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *) &val,
+                   sizeof(val)) < 0)
+    {
+        fprintf(stderr, "Warning:  setsockopt(TCP_NODELAY) failed\n");
+    }
+
 	val = fcntl(fd, F_GETFL, 0);
 	fcntl(fd, F_SETFL, val | O_NONBLOCK);
 
+    /* completion is reported by the socket becoming writable */
+    if (connect(fd, (struct sockaddr *) &addr->ss, addr->len) != 0
+        && errno != EINPROGRESS)
+    {
+        err = errno;
+        if (local == NULL || err != EADDRNOTAVAIL) {
+            fprintf(stderr, "Error connect tcp socket\n");
+        }
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
     return fd;
 }
 
+/*
+ * dns_perf_socket_state:
+ *     returns the pending error of a socket, e.g. the result of a
+ *     non-blocking connect().
+ */
 int dns_perf_socket_state(int fd)
 {
 	int       status = 0;
@@ -109,5 +295,5 @@ int dns_perf_socket_state(int fd)
         return -1;
     }
 
-    return 0;
+    return status;
 }
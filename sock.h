@@ -5,15 +5,40 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 
-#define DEFAULT_BUF_SIZE  8
+#define DEFAULT_BUF_SIZE  8      /* KB */
+#define POOL_BUF_SIZE     1024   /* KB, a pooled socket carries many queries */
 
-int dns_perf_open_udp_socket(char *host, unsigned int port, int family);
-int dns_perf_open_tcp_socket(char *host, unsigned int port, int family);
+/* an IPv4 or IPv6 socket address */
+typedef struct dns_perf_addr_s {
+    struct sockaddr_storage  ss;
+    socklen_t                len;
+} dns_perf_addr_t;
+
+/* a local address or CIDR range queries are sent from */
+typedef struct dns_perf_source_s {
+    int            family;
+    unsigned char  addr[16];   /* first address, the host bits cleared */
+    unsigned int   prefix;
+    uint64_t       count;      /* of addresses, at most 2^32 */
+} dns_perf_source_t;
+
+int dns_perf_resolve_addr(const char *host, unsigned int port, int family,
+    dns_perf_addr_t *addr);
+int dns_perf_parse_source(const char *s, dns_perf_source_t *src);
+void dns_perf_source_addr(dns_perf_source_t *src, uint64_t n,
+    unsigned int port, dns_perf_addr_t *addr);
+int dns_perf_open_udp_socket(dns_perf_addr_t *addr, dns_perf_addr_t *local,
+    int bufsize);
+int dns_perf_open_tcp_socket(dns_perf_addr_t *addr, dns_perf_addr_t *local);
 
 int dns_perf_socket_state(int fd);
 #endif
@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+#
+# Open loop (-T) latency is measured from the time a query was due.  The
+# sender is stopped for a while in the middle of the run, the queries due
+# meanwhile are sent late and their latency must include the backlog.
+
+import json, os, signal, socket, subprocess, sys, tempfile, threading, time
+
+STALL = 0.6     # seconds the sender is stopped
+
+def responder(sock):
+    while True:
+        q, addr = sock.recvfrom(65535)
+        if len(q) >= 12:
+            sock.sendto(q[:2] + bytes([q[2] | 0x80, q[3]]) + q[4:], addr)
+
+def main():
+    top = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("127.0.0.1", 0))
+    threading.Thread(target=responder, args=(sock,), daemon=True).start()
+
+    out = tempfile.NamedTemporaryFile(suffix=".json", delete=False).name
+
+    p = subprocess.Popen([os.path.join(top, "dnsperf"),
+                          "-s", "127.0.0.1", "-p", str(sock.getsockname()[1]),
+                          "-d", os.path.join(top, "a.out"), "-T", "1000",
+                          "-l", "3", "-c", "5000", "-S", "1", "-o", out],
+                         stdout=subprocess.DEVNULL)
+
+    time.sleep(1)
+    p.send_signal(signal.SIGSTOP)
+    time.sleep(STALL)
+    p.send_signal(signal.SIGCONT)
+
+    if p.wait() != 0:
+        print("FAIL: dnsperf exited with %d" % p.returncode)
+        return 1
+
+    with open(out) as f:
+        result = json.load(f)
+    os.unlink(out)
+
+    latency = result["servers"][0]["latency_us"]
+    if latency["max"] < STALL * 0.8 * 1000000:
+        print("FAIL: max latency %d us hides a %.1f s stall"
+              % (latency["max"], STALL))
+        return 1
+
+    print("PASS: max latency %d us over a %.1f s stall" % (latency["max"], STALL))
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,159 @@
+/*
+ * This file if part of dnsperf.
+ *
+ * Copyright (C) 2014 Cobblau
+ *
+ * dnsperf is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dnsperf is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <timer.h>
+
+
+/*
+ * dns_perf_timer_wheel_init:
+ *     `tick' is the resolution of the wheel and `span' the longest timeout
+ *     it covers in one round, both in usec.
+ */
+int dns_perf_timer_wheel_init(dns_perf_timer_wheel_t *wheel, uint64_t tick,
+                              uint64_t span, uint64_t now)
+{
+    unsigned int  size, i;
+
+    for (size = 256; size < span / tick + 1; size <<= 1) {
+        /* void */
+    }
+
+    if ((wheel->slots = calloc(size, sizeof(*wheel->slots))) == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < size; i++) {
+        LIST_INIT(wheel->slots[i]);
+    }
+
+    wheel->mask = size - 1;
+    wheel->tick = tick;
+    wheel->current = now / tick;
+    wheel->count = 0;
+
+    return 0;
+}
+
+void dns_perf_timer_wheel_destroy(dns_perf_timer_wheel_t *wheel)
+{
+    free(wheel->slots);
+    wheel->slots = NULL;
+}
+
+void dns_perf_timer_add(dns_perf_timer_wheel_t *wheel, dns_perf_timer_t *t,
+                        uint64_t expire)
+{
+    uint64_t  tick;
+
+    if (dns_perf_timer_is_armed(t)) {
+        dns_perf_timer_del(wheel, t);
+    }
+
+    /* a timer already expired fires on the next dns_perf_timer_expire() */
+    tick = expire / wheel->tick;
+    if (tick < wheel->current) {
+        tick = wheel->current;
+    }
+
+    t->expire = expire;
+    t->slot = tick & wheel->mask;
+    LIST_APPEND(wheel->slots[t->slot], t, link);
+    wheel->count++;
+}
+
+void dns_perf_timer_del(dns_perf_timer_wheel_t *wheel, dns_perf_timer_t *t)
+{
+    if (!dns_perf_timer_is_armed(t)) {
+        return;
+    }
+
+    LIST_UNLINK(wheel->slots[t->slot], t, link);
+    wheel->count--;
+}
+
+/*
+ * dns_perf_timer_expire:
+ *     run the handlers of the timers expired at `now', returns how many.
+ */
+int dns_perf_timer_expire(dns_perf_timer_wheel_t *wheel, uint64_t now)
+{
+    uint64_t           last, tick;
+    dns_perf_timer_t  *t, *next;
+    int                n = 0;
+
+    last = now / wheel->tick;
+
+    /* no need to go round more than once */
+    if (last - wheel->current > wheel->mask) {
+        wheel->current = last - wheel->mask;
+    }
+
+    for (tick = wheel->current; tick <= last; tick++) {
+
+        for (t = LIST_HEAD(wheel->slots[tick & wheel->mask]); t != NULL; t = next) {
+            next = LIST_NEXT(t, link);
+
+            /* armed for a later round */
+            if (t->expire > now) {
+                continue;
+            }
+
+            LIST_UNLINK(wheel->slots[tick & wheel->mask], t, link);
+            wheel->count--;
+            n++;
+
+            t->handler(t);
+        }
+    }
+
+    /* the slot of `last' may still hold timers expiring later in this tick */
+    wheel->current = last;
+
+    return n;
+}
+
+/*
+ * dns_perf_timer_next:
+ *     milliseconds until the next timer may expire, at most `max'.
+ */
+long dns_perf_timer_next(dns_perf_timer_wheel_t *wheel, uint64_t now, long max)
+{
+    uint64_t  tick, last;
+
+    if (wheel->count == 0) {
+        return max;
+    }
+
+    last = wheel->current + wheel->mask;
+    if (last > wheel->current + (uint64_t) max * 1000 / wheel->tick) {
+        last = wheel->current + (uint64_t) max * 1000 / wheel->tick;
+    }
+
+    for (tick = wheel->current; tick <= last; tick++) {
+        if (!LIST_EMPTY(wheel->slots[tick & wheel->mask])) {
+            break;
+        }
+    }
+
+    if ((tick + 1) * wheel->tick <= now) {
+        return 0;
+    }
+
+    return ((tick + 1) * wheel->tick - now + 999) / 1000;
+}
@@ -0,0 +1,44 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <list.h>
+
+/*
+ * Timer wheel: a timer is linked in the slot of the tick it expires at,
+ * so arming and cancelling are O(1) and only the slots of the ticks that
+ * passed are visited.  The wheel is sized to cover the longest timeout
+ * expected, a longer timer simply stays in its slot for more rounds.
+ */
+typedef struct dns_perf_timer_s dns_perf_timer_t;
+
+struct dns_perf_timer_s {
+    LINK(dns_perf_timer_t) link;
+    uint64_t      expire;                      /* usec */
+    unsigned int  slot;
+    void        (*handler)(dns_perf_timer_t *t);
+};
+
+typedef struct dns_perf_timer_wheel_s {
+    LIST(dns_perf_timer_t) *slots;
+    unsigned int  mask;       /* number of slots - 1 */
+    uint64_t      tick;       /* usec per slot */
+    uint64_t      current;    /* next tick to be expired */
+    unsigned int  count;      /* armed timers */
+} dns_perf_timer_wheel_t;
+
+#define dns_perf_timer_init(t, h)   \
+    do { LINK_INIT(t, link); (t)->handler = (h); } while (0)
+#define dns_perf_timer_is_armed(t)  LINK_LINKED(t, link)
+
+int  dns_perf_timer_wheel_init(dns_perf_timer_wheel_t *wheel, uint64_t tick,
+                               uint64_t span, uint64_t now);
+void dns_perf_timer_wheel_destroy(dns_perf_timer_wheel_t *wheel);
+void dns_perf_timer_add(dns_perf_timer_wheel_t *wheel, dns_perf_timer_t *t,
+                        uint64_t expire);
+void dns_perf_timer_del(dns_perf_timer_wheel_t *wheel, dns_perf_timer_t *t);
+int  dns_perf_timer_expire(dns_perf_timer_wheel_t *wheel, uint64_t now);
+long dns_perf_timer_next(dns_perf_timer_wheel_t *wheel, uint64_t now, long max);
+
+#endif